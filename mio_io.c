@@ -32,10 +32,25 @@
 //	10/09/12	  3.1		Renamed file to pcmmio_ws
 //	11/07/18	  4.0		Changed some function names
 //                          Minor code clean-up
+//	10/19/26	  5.0		Added adc_scan_channels
+//                          Added DIO interrupt rule functions
+//                          Added ADC alarm and event functions
+//                          Added mio_wait_sources
+//                          Added mio_set_eventfd
+//                          Added mio_submit
+//                          Added quadrature functions
+//                          Added both edge interrupts
+//                          Added dio_set_pwm
+//                          Added dio_scan_ports
+//                          Added mio_map_state and mio_read_state
+//                          Added mio_splice_events
+//                          Added mio_set_priority
+//                          Added mio_get_config
 //
 //****************************************************************************
 
 #define LIB_DEFINED
+#define _GNU_SOURCE     // splice
 
 #include "mio_io.h"    
 
@@ -43,10 +58,16 @@
 #include <fcntl.h>      // open  
 #include <unistd.h>     // exit 
 #include <sys/ioctl.h>  // ioctl 
+#include <sys/mman.h>   // mmap
+#include <string.h>     // memcpy
+#include <errno.h>      // errno
 
 // These image variable help out where a register is not
 // capable of a read/modify/write operation 
 unsigned char dio_port_images[MAX_DEV][6];
+
+// Set when the driver applied a saved configuration to the device
+int config_loaded[MAX_DEV];
 unsigned char adc1_port_image[MAX_DEV] = {0, 0, 0, 0};
 unsigned char adc2_port_image[MAX_DEV] = {0, 0, 0, 0};
 unsigned char dac1_port_image[MAX_DEV] = {0x10, 0x10, 0x10, 0x10};
@@ -119,6 +140,12 @@ char *device_id[MAX_DEV] ={"/dev/pcmmio_wsa",
                            "/dev/pcmmio_wsc",
                            "/dev/pcmmio_wsd"};
 
+// State pages mapped by mio_map_state
+const volatile struct mio_state *state_page[MAX_DEV];
+
+// Pipes used by mio_splice_events
+int splice_pipe[MAX_DEV][2];
+
 //------------------------------------------------------------------------
 //
 // check_handle
@@ -147,7 +174,21 @@ int check_handle(int dev_num)
     handle[dev_num] = open(device_id[dev_num], O_RDWR);
 
     if (handle[dev_num] > 0)	// If it's now a valid handle  
+    {
+        struct mio_config cfg;
+
+        // Start from the setup the driver holds rather than power up
+        // defaults. Another program may have changed it since load even
+        // when no saved setup was applied.
+        if (ioctl(handle[dev_num], MIO_GET_CONFIG, &cfg) == 0 && cfg.magic == MIO_CONFIG_MAGIC)
+        {
+            memcpy(adc_channel_mode[dev_num], cfg.adc_mode, sizeof(cfg.adc_mode));
+            memcpy(dio_port_images[dev_num], cfg.dio_ports, sizeof(cfg.dio_ports));
+            config_loaded[dev_num] = (cfg.flags & MIO_CONFIG_APPLIED) != 0;
+        }
+
         return 0;
+    }
 
     mio_error_code = MIO_OPEN_ERROR;
     sprintf(mio_error_string, "MIO - Unable to open device PCMMIO\n");
@@ -1289,6 +1330,177 @@ void adc_wait_int(int dev_num, int adc_num)
         ioctl(handle[dev_num], ADC1_WAIT_INT, NULL);
 }
 
+//------------------------------------------------------------------------
+//
+// adc_scan_channels
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			channels	Bit mask of channels to convert (bit n = channel n)
+//			flags		MIO_SCAN_PARALLEL to run both converters together
+//			buffer		Storage of channel data, indexed by channel
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+//------------------------------------------------------------------------
+void adc_scan_channels(int dev_num, unsigned short channels, int flags, unsigned short *buffer)
+{
+    struct mio_adc_scan scan;
+    int i;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (ADC) : Bad Device Number %d\n", dev_num);
+        return;
+    }
+
+    if (buffer == NULL)
+    {
+        mio_error_code = MIO_NULL_POINTER;
+        sprintf(mio_error_string, "MIO (ADC) : Null buffer pointer\n");
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    // The whole scan, including the pipeline flush conversions, runs
+    // in the driver with a single call
+    scan.channels = channels;
+    scan.flags = flags;
+
+    if (ioctl(handle[dev_num], ADC_SCAN, &scan))
+    {
+        mio_error_code = MIO_TIMEOUT_ERROR;
+        sprintf(mio_error_string, "MIO (ADC) : Scan - Device timeout error\n");
+        return;
+    }
+
+    for (i = 0; i < 16; i++)
+        if (channels & (1 << i))
+            buffer[i] = scan.data[i];
+}
+
+//------------------------------------------------------------------------
+//
+// adc_set_alarm
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			channel		ADC channel
+//			mode		MIO_ALARM_HIGH, MIO_ALARM_LOW, MIO_ALARM_WINDOW
+//						or 0 to disable the alarm
+//			low			Low limit in ADC counts
+//			high		High limit in ADC counts
+//			hysteresis	Counts the value must come back by to clear
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// Limits are in the units returned by adc_read_conversion_data, signed
+// for bipolar channels. Alarms are checked by the driver's monitor, see
+// adc_start_monitor, and reported through mio_read_event.
+//
+//------------------------------------------------------------------------
+void adc_set_alarm(int dev_num, int channel, int mode, int low, int high, unsigned short hysteresis)
+{
+    struct mio_adc_alarm alarm;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (ADC) : Bad Device Number %d\n", dev_num);
+        return;
+    }
+
+    if (channel < 0 || channel > 15)
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (ADC) : Bad Channel Number %d\n", channel);
+        return;
+    }
+
+    if (mode & ~MIO_ALARM_WINDOW)
+    {
+        mio_error_code = MIO_BAD_MODE_NUMBER;
+        sprintf(mio_error_string, "MIO (ADC) : Bad Alarm Mode %d\n", mode);
+        return;
+    }
+
+    if (mode == MIO_ALARM_WINDOW && low > high)
+    {
+        mio_error_code = MIO_BAD_RANGE;
+        sprintf(mio_error_string, "MIO (ADC) : Bad Alarm Window %d - %d\n", low, high);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    alarm.channel = channel;
+    alarm.mode = mode;
+    alarm.hysteresis = hysteresis;
+    alarm.low = low;
+    alarm.high = high;
+
+    ioctl(handle[dev_num], ADC_SET_ALARM, &alarm);
+}
+
+//------------------------------------------------------------------------
+//
+// adc_start_monitor
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			period_ms	Time between scans in milliseconds, 0 stops,
+//						otherwise MIN_MONITOR_PERIOD and up
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// The driver converts every channel with an alarm set once per period
+// and only queues an event when a channel crosses a limit. While the
+// monitor runs other conversions should go through adc_scan_channels,
+// which shares the converters with it.
+//
+//------------------------------------------------------------------------
+void adc_start_monitor(int dev_num, int period_ms)
+{
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (ADC) : Bad Device Number %d\n", dev_num);
+        return;
+    }
+
+    if (period_ms < 0 || (period_ms && period_ms < MIN_MONITOR_PERIOD))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO (ADC) : Bad Monitor Period %d\n", period_ms);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    if (ioctl(handle[dev_num], ADC_MONITOR, period_ms))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO (ADC) : Monitor setup failed\n");
+    }
+}
+
 //------------------------------------------------------------------------
 //
 // dac_set_span
@@ -2203,12 +2415,15 @@ void dio_write_byte(int dev_num, int offset, unsigned char value)
 // Arguments:
 //			dev_num		The index of the chip
 //			bit_number	Bit to clear
-//			polarity	Rising or falling edge
+//			polarity	RISING, FALLING or BOTH_EDGES
 //
 // Return value in mio_error_code:
 //			0	The function completes successfully
 //          any other return value indicates function failed
 //
+// The card can only interrupt on one edge. For BOTH_EDGES the driver
+// flips the polarity after every interrupt.
+//
 //------------------------------------------------------------------------
 void dio_enab_bit_int(int dev_num, int bit_number, int polarity)
 {
@@ -2232,7 +2447,7 @@ void dio_enab_bit_int(int dev_num, int bit_number, int polarity)
         return;
     }
 
-    if ((polarity != RISING) && (polarity != FALLING))
+    if ((polarity != RISING) && (polarity != FALLING) && (polarity != BOTH_EDGES))
     {
         mio_error_code = MIO_BAD_POLARITY;
         sprintf(mio_error_string, "MIO (DIO) : Bad interrupt polarity %d\n", polarity);
@@ -2278,6 +2493,18 @@ void dio_enab_bit_int(int dev_num, int bit_number, int polarity)
 
     // Set access back to page 3
     mio_write_reg(dev_num, DIO_PAGE_LOCK, PAGE3);
+
+    // Tell the driver whether to flip the polarity on every edge, for
+    // both edges it arms the bit for the edge away from its level
+    if (ioctl(handle[dev_num], DIO_BOTH_EDGES, ((polarity == BOTH_EDGES) << 8) | (bit_number + 1)) < 0)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+
+        if (errno == EBUSY)
+            sprintf(mio_error_string, "MIO (DIO) : Bit %d is used by a quadrature channel\n", bit_number + 1);
+        else
+            sprintf(mio_error_string, "MIO (DIO) : Unable to set edge mode for bit %d\n", bit_number + 1);
+    }
 }
 
 //------------------------------------------------------------------------
@@ -2476,57 +2703,986 @@ int dio_wait_int(int dev_num)
 
 //------------------------------------------------------------------------
 //
-// mio_read_reg
+// dio_add_output_rule
 //
 // Arguments:
 //			dev_num		The index of the chip
-//			offset		Register offset
+//			bit_number	DIO bit whose interrupt triggers the rule
+//			edge		RISING or FALLING
+//			port		DIO port to write (0-5)
+//			mask		Bits of the port to change
+//			value		New state of the masked bits
 //
 // Returns:
-//			value returned is the byte read
+//			index of the new rule, -1 on failure
 //          mio_error_code must be MIO_SUCCESS 
 //          for return value to be valid
 //
+// The driver applies the write from its interrupt handler as soon as
+// the edge is seen. The interrupt for bit_number must be enabled with
+// dio_enab_bit_int using the same polarity. The driver does not update
+// this library's port images, so avoid dio_write_bit on the same port.
+//
 //------------------------------------------------------------------------
-unsigned char mio_read_reg(int dev_num, int offset)
+int dio_add_output_rule(int dev_num, int bit_number, int edge, int port, unsigned char mask, unsigned char value)
 {
+    struct mio_rule rule;
     int val;
 
     mio_error_code = MIO_SUCCESS;
 
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad device number %d\n", dev_num);
+        return -1;
+    }
+
+    if ((bit_number < 1) || (bit_number > 24))
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DIO) : Bad bit number %d\n", bit_number);
+        return -1;
+    }
+
+    if (edge != RISING && edge != FALLING)
+    {
+        mio_error_code = MIO_BAD_POLARITY;
+        sprintf(mio_error_string, "MIO (DIO) : Bad interrupt polarity %d\n", edge);
+        return -1;
+    }
+
+    if (port < 0 || port > 5)
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DIO) : Bad port number %d\n", port);
+        return -1;
+    }
+
     if (check_handle(dev_num))   // Check for chip available  
         return -1;
 
-    // This is a catchall register read routine that allows reading of
-    // ANY of the registers on the PCM-MIO. It is used primarily for
-    // retreiving control and access values in the hardware.  
-    val = ioctl(handle[dev_num], MIO_READ_REG, offset);
+    rule.bit = bit_number;
+    rule.edge = edge;
+    rule.action = MIO_RULE_DIO;
+    rule.target = port;
+    rule.mask = mask;
+    rule.value = value & mask;
+    rule.code = 0;
 
-    return (unsigned char) (val & 0xff);
+    val = ioctl(handle[dev_num], DIO_ADD_RULE, &rule);
+
+    if (val < 0)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+
+        if (errno == ENOSPC)
+            sprintf(mio_error_string, "MIO (DIO) : Rule table full\n");
+        else if (errno == EINVAL)
+            sprintf(mio_error_string, "MIO (DIO) : Rule rejected as invalid\n");
+        else
+            sprintf(mio_error_string, "MIO (DIO) : Unable to add rule\n");
+
+        return -1;
+    }
+
+    return val;
 }
 
 //------------------------------------------------------------------------
 //
-// mio_write_reg
+// dio_add_dac_rule
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			bit_number	DIO bit whose interrupt triggers the rule
+//			edge		RISING or FALLING
+//			channel		DAC channel (0-7)
+//			dac_value	Output code to load
+//
+// Returns:
+//			index of the new rule, -1 on failure
+//          mio_error_code must be MIO_SUCCESS 
+//          for return value to be valid
+//
+// The span of the channel is not changed, set it with dac_set_span first.
+//
+//------------------------------------------------------------------------
+int dio_add_dac_rule(int dev_num, int bit_number, int edge, int channel, unsigned short dac_value)
+{
+    struct mio_rule rule;
+    int val;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad device number %d\n", dev_num);
+        return -1;
+    }
+
+    if ((bit_number < 1) || (bit_number > 24))
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DIO) : Bad bit number %d\n", bit_number);
+        return -1;
+    }
+
+    if (edge != RISING && edge != FALLING)
+    {
+        mio_error_code = MIO_BAD_POLARITY;
+        sprintf(mio_error_string, "MIO (DIO) : Bad interrupt polarity %d\n", edge);
+        return -1;
+    }
+
+    if (channel < 0 || channel > 7)
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DAC) : Bad Channel Number %d\n", channel);
+        return -1;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return -1;
+
+    rule.bit = bit_number;
+    rule.edge = edge;
+    rule.action = MIO_RULE_DAC;
+    rule.target = channel;
+    rule.mask = 0;
+    rule.value = 0;
+    rule.code = dac_value;
+
+    val = ioctl(handle[dev_num], DIO_ADD_RULE, &rule);
+
+    if (val < 0)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+
+        if (errno == ENOSPC)
+            sprintf(mio_error_string, "MIO (DIO) : Rule table full\n");
+        else if (errno == EINVAL)
+            sprintf(mio_error_string, "MIO (DIO) : Rule rejected as invalid\n");
+        else
+            sprintf(mio_error_string, "MIO (DIO) : Unable to add rule\n");
+
+        return -1;
+    }
+
+    return val;
+}
+
+//------------------------------------------------------------------------
+//
+// dio_clear_rules
 //
 // Arguments:
 //			dev_num		The index of the chip
-//			offset		Register offset
-//			value		New register value
 //
 // Return value in mio_error_code:
 //			0	The function completes successfully
 //          any other return value indicates function failed
 //
 //------------------------------------------------------------------------
-void mio_write_reg(int dev_num, int offset, unsigned char value)
+void dio_clear_rules(int dev_num)
 {
     mio_error_code = MIO_SUCCESS;
 
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad device number %d\n", dev_num);
+        return;
+    }
+
     if (check_handle(dev_num))   // Check for chip available  
         return;
 
-    // This function like the previous allow unlimited
-    // write access to ALL of the registers on the PCM-MIO  
-    ioctl(handle[dev_num], MIO_WRITE_REG, (value << 8) | offset);
+    ioctl(handle[dev_num], DIO_CLEAR_RULES, NULL);
+}
+
+//------------------------------------------------------------------------
+//
+// dio_set_quadrature
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			channel		Quadrature channel (0-11)
+//			bit_a		DIO bit for the A phase, 0 turns the channel off
+//			bit_b		DIO bit for the B phase
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// The driver enables the interrupts of both bits itself and decodes
+// every edge, use dio_read_quadrature to collect the positions.
+//
+//------------------------------------------------------------------------
+void dio_set_quadrature(int dev_num, int channel, int bit_a, int bit_b)
+{
+    struct mio_quad quad;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad device number %d\n", dev_num);
+        return;
+    }
+
+    if (channel < 0 || channel > MAX_QUAD - 1)
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DIO) : Bad quadrature channel %d\n", channel);
+        return;
+    }
+
+    if (bit_a && (bit_a < 1 || bit_a > 24 || bit_b < 1 || bit_b > 24 || bit_a == bit_b))
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DIO) : Bad quadrature bits %d, %d\n", bit_a, bit_b);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    quad.channel = channel;
+    quad.bit_a = bit_a;
+    quad.bit_b = bit_b;
+    quad.reserved = 0;
+
+    if (ioctl(handle[dev_num], DIO_SET_QUAD, &quad))
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DIO) : Quadrature bits in use %d, %d\n", bit_a, bit_b);
+    }
+}
+
+//------------------------------------------------------------------------
+//
+// dio_read_quadrature
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			positions	MAX_QUAD positions, may be NULL
+//			errors		MAX_QUAD error counts, may be NULL
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+//------------------------------------------------------------------------
+void dio_read_quadrature(int dev_num, long long *positions, unsigned int *errors)
+{
+    struct mio_quad_state state;
+    int i;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad device number %d\n", dev_num);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    if (ioctl(handle[dev_num], DIO_GET_QUAD, &state))
+    {
+        mio_error_code = MIO_TIMEOUT_ERROR;
+        sprintf(mio_error_string, "MIO (DIO) : Quadrature read failed\n");
+        return;
+    }
+
+    for (i = 0; i < MAX_QUAD; i++)
+    {
+        if (positions)
+            positions[i] = state.position[i];
+
+        if (errors)
+            errors[i] = state.errors[i];
+    }
+}
+
+//------------------------------------------------------------------------
+//
+// dio_set_pwm
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			bit_number	Output bit (1-48)
+//			period_us	PWM period in microseconds, 0 stops the output
+//			duty_us		Time the output is high in each period
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// The driver times the edges itself, the output keeps running until
+// it is stopped or the driver is unloaded.
+//
+//------------------------------------------------------------------------
+void dio_set_pwm(int dev_num, int bit_number, unsigned int period_us, unsigned int duty_us)
+{
+    struct mio_pwm pwm;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad device number %d\n", dev_num);
+        return;
+    }
+
+    if ((bit_number < 1) || (bit_number > 48))
+    {
+        mio_error_code = MIO_BAD_CHANNEL_NUMBER;
+        sprintf(mio_error_string, "MIO (DIO) : Bad bit number %d\n", bit_number);
+        return;
+    }
+
+    if ((period_us && period_us < MIN_PWM_PERIOD) || duty_us > period_us)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad PWM period %u duty %u\n", period_us, duty_us);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    pwm.bit = bit_number;
+    pwm.reserved[0] = pwm.reserved[1] = pwm.reserved[2] = 0;
+    pwm.period_us = period_us;
+    pwm.duty_us = duty_us;
+
+    if (ioctl(handle[dev_num], DIO_SET_PWM, &pwm))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO (DIO) : PWM setup failed on bit %d\n", bit_number);
+    }
+}
+
+//------------------------------------------------------------------------
+//
+// dio_scan_ports
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			period_us	Sampling period in microseconds, 0 stops
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// Bits 25-48 cannot interrupt. While the driver scans them every change
+// is reported like an interrupt, so dio_get_int, dio_wait_int and
+// mio_read_event return bit numbers up to 48.
+//
+//------------------------------------------------------------------------
+void dio_scan_ports(int dev_num, unsigned int period_us)
+{
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad device number %d\n", dev_num);
+        return;
+    }
+
+    if (period_us && period_us < MIN_SCAN_PERIOD)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO (DIO) : Bad scan period %u\n", period_us);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    if (ioctl(handle[dev_num], DIO_SCAN, period_us))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO (DIO) : Scan setup failed\n");
+    }
+}
+
+//------------------------------------------------------------------------
+//
+// mio_read_reg
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			offset		Register offset
+//
+// Returns:
+//			value returned is the byte read
+//          mio_error_code must be MIO_SUCCESS 
+//          for return value to be valid
+//
+//------------------------------------------------------------------------
+unsigned char mio_read_reg(int dev_num, int offset)
+{
+    int val;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return -1;
+
+    // This is a catchall register read routine that allows reading of
+    // ANY of the registers on the PCM-MIO. It is used primarily for
+    // retreiving control and access values in the hardware.  
+    val = ioctl(handle[dev_num], MIO_READ_REG, offset);
+
+    return (unsigned char) (val & 0xff);
+}
+
+//------------------------------------------------------------------------
+//
+// mio_write_reg
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			offset		Register offset
+//			value		New register value
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+//------------------------------------------------------------------------
+void mio_write_reg(int dev_num, int offset, unsigned char value)
+{
+    mio_error_code = MIO_SUCCESS;
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    // This function like the previous allow unlimited
+    // write access to ALL of the registers on the PCM-MIO  
+    ioctl(handle[dev_num], MIO_WRITE_REG, (value << 8) | offset);
+}
+
+//------------------------------------------------------------------------
+//
+// mio_read_event
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			event		Buffer for the next event
+//
+// Returns:
+//			1 when an event was returned, -1 on failure
+//          mio_error_code must be MIO_SUCCESS 
+//          for return value to be valid
+//
+// Blocks until a DIO interrupt, an ADC alarm or a command completion is
+// available. DIO events carry the six ports as the driver read them when
+// the interrupt was decoded, so there is no need to follow up with
+// dio_read_byte. Events read here are no longer returned by dio_get_int
+// or dio_wait_int.
+//
+//------------------------------------------------------------------------
+int mio_read_event(int dev_num, struct mio_event *event)
+{
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return -1;
+    }
+
+    if (event == NULL)
+    {
+        mio_error_code = MIO_NULL_POINTER;
+        sprintf(mio_error_string, "MIO : Null event pointer\n");
+        return -1;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return -1;
+
+    if (read(handle[dev_num], event, sizeof(*event)) != sizeof(*event))
+    {
+        mio_error_code = MIO_TIMEOUT_ERROR;
+        sprintf(mio_error_string, "MIO : Event read failed\n");
+        return -1;
+    }
+
+    return 1;
+}
+
+//------------------------------------------------------------------------
+//
+// mio_wait_sources
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			mask		MIO_SRC_xxx sources to wait for
+//			timeout_ms	Maximum time to wait, 0 waits forever
+//			counts		MIO_SOURCES completion counters
+//
+// Returns:
+//			mask of the sources that completed, 0 on timeout, -1 on failure
+//          mio_error_code must be MIO_SUCCESS 
+//          for return value to be valid
+//
+// counts holds the counters from the previous call on entry and the
+// current counters on return. Start with zeros, the first call then
+// returns straight away with the counters as they stand.
+//
+//------------------------------------------------------------------------
+int mio_wait_sources(int dev_num, int mask, int timeout_ms, unsigned int *counts)
+{
+    struct mio_wait wait;
+    int i;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return -1;
+    }
+
+    if (counts == NULL)
+    {
+        mio_error_code = MIO_NULL_POINTER;
+        sprintf(mio_error_string, "MIO : Null counter pointer\n");
+        return -1;
+    }
+
+    if (mask == 0 || mask >= (1 << MIO_SOURCES))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO : Bad source mask %x\n", mask);
+        return -1;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return -1;
+
+    wait.mask = mask;
+    wait.timeout_ms = timeout_ms;
+
+    for (i = 0; i < MIO_SOURCES; i++)
+        wait.count[i] = counts[i];
+
+    if (ioctl(handle[dev_num], MIO_WAIT, &wait) < 0)
+    {
+        mio_error_code = MIO_TIMEOUT_ERROR;
+        sprintf(mio_error_string, "MIO : Wait interrupted\n");
+        return -1;
+    }
+
+    for (i = 0; i < MIO_SOURCES; i++)
+        counts[i] = wait.count[i];
+
+    return wait.ready;
+}
+
+//------------------------------------------------------------------------
+//
+// mio_set_eventfd
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			fd			eventfd to signal
+//			mask		MIO_SRC_xxx sources, 0 unbinds the eventfd
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// The eventfd counter goes up by one for every completion of a selected
+// source, so a reader learns how many happened since its last read.
+//
+//------------------------------------------------------------------------
+void mio_set_eventfd(int dev_num, int fd, int mask)
+{
+    struct mio_eventfd efd;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return;
+    }
+
+    if (mask < 0 || mask >= (1 << MIO_SOURCES))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO : Bad source mask %x\n", mask);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    efd.fd = fd;
+    efd.mask = mask;
+
+    if (ioctl(handle[dev_num], MIO_SET_EVENTFD, &efd) < 0)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO : Unable to bind eventfd %d\n", fd);
+    }
+}
+
+//------------------------------------------------------------------------
+//
+// mio_submit
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			cmds		Commands to submit
+//			count		Number of commands
+//
+// Returns:
+//			number of commands accepted, -1 on failure
+//          mio_error_code must be MIO_SUCCESS 
+//          for return value to be valid
+//
+// Completions are collected with mio_read_event. Fewer than count
+// commands are accepted when the driver has MAX_PENDING waits in flight
+// or this process has MAX_COMPLETIONS completions it has not read.
+//
+//------------------------------------------------------------------------
+int mio_submit(int dev_num, struct mio_cmd *cmds, int count)
+{
+    int val;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return -1;
+    }
+
+    if (cmds == NULL)
+    {
+        mio_error_code = MIO_NULL_POINTER;
+        sprintf(mio_error_string, "MIO : Null command pointer\n");
+        return -1;
+    }
+
+    if (count <= 0)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO : Bad command count %d\n", count);
+        return -1;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return -1;
+
+    val = write(handle[dev_num], cmds, count * sizeof(*cmds));
+
+    if (val < 0)
+    {
+        mio_error_code = MIO_BAD_COMMAND;
+        sprintf(mio_error_string, "MIO : Command submission failed\n");
+        return -1;
+    }
+
+    return val / sizeof(*cmds);
+}
+
+//------------------------------------------------------------------------
+//
+// mio_map_state
+//
+// Arguments:
+//			dev_num		The index of the chip
+//
+// Returns:
+//			the driver's state page, NULL on failure
+//          mio_error_code must be MIO_SUCCESS 
+//          for return value to be valid
+//
+// The page is mapped once and stays mapped. Fields can be read directly
+// when a single one is enough, use mio_read_state for a consistent copy
+// of several.
+//
+//------------------------------------------------------------------------
+const volatile struct mio_state *mio_map_state(int dev_num)
+{
+    void *page;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return NULL;
+    }
+
+    if (state_page[dev_num])
+        return state_page[dev_num];
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return NULL;
+
+    page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, handle[dev_num], 0);
+
+    if (page == MAP_FAILED)
+    {
+        mio_error_code = MIO_OPEN_ERROR;
+        sprintf(mio_error_string, "MIO : Unable to map state page\n");
+        return NULL;
+    }
+
+    state_page[dev_num] = page;
+
+    return state_page[dev_num];
+}
+
+//------------------------------------------------------------------------
+//
+// mio_read_state
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			state		Buffer for a copy of the state page
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// No system call is made once the page is mapped. The copy is retried
+// while the driver is updating the page.
+//
+//------------------------------------------------------------------------
+void mio_read_state(int dev_num, struct mio_state *state)
+{
+    const volatile struct mio_state *page;
+    unsigned int seq;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (state == NULL)
+    {
+        mio_error_code = MIO_NULL_POINTER;
+        sprintf(mio_error_string, "MIO : Null state pointer\n");
+        return;
+    }
+
+    page = mio_map_state(dev_num);
+
+    if (page == NULL)
+        return;
+
+    do
+    {
+        while ((seq = page->seq) & 1)
+            ;
+
+        __sync_synchronize();
+        memcpy(state, (const void *) page, sizeof(*state));
+        __sync_synchronize();
+    } while (page->seq != seq);
+}
+
+//------------------------------------------------------------------------
+//
+// mio_splice_events
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			fd			File or socket to append the events to
+//			count		Maximum number of events to move
+//
+// Returns:
+//			number of events moved, -1 on failure
+//          mio_error_code must be MIO_SUCCESS 
+//          for return value to be valid
+//
+// Blocks like mio_read_event until at least one event is available. The
+// records are moved through a pipe with splice, they are never copied
+// into the caller's memory.
+//
+//------------------------------------------------------------------------
+int mio_splice_events(int dev_num, int fd, int count)
+{
+    ssize_t val, moved, n;
+
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return -1;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return -1;
+
+    if (splice_pipe[dev_num][1] <= 0 && pipe(splice_pipe[dev_num]))
+    {
+        splice_pipe[dev_num][0] = splice_pipe[dev_num][1] = 0;
+        mio_error_code = MIO_OPEN_ERROR;
+        sprintf(mio_error_string, "MIO : Unable to create splice pipe\n");
+        return -1;
+    }
+
+    val = splice(handle[dev_num], NULL, splice_pipe[dev_num][1], NULL,
+                 count * sizeof(struct mio_event), 0);
+
+    if (val < 0)
+    {
+        mio_error_code = MIO_SPLICE_ERROR;
+        sprintf(mio_error_string, "MIO : Event splice failed\n");
+        return -1;
+    }
+
+    // Drain the pipe completely so the next call starts on a record boundary
+    for (moved = 0; moved < val; moved += n)
+    {
+        n = splice(splice_pipe[dev_num][0], NULL, fd, NULL, val - moved, SPLICE_F_MOVE);
+
+        if (n <= 0)
+        {
+            // The records left behind would be handed to the next call,
+            // drop them with the pipe, it is recreated on the next call
+            close(splice_pipe[dev_num][0]);
+            close(splice_pipe[dev_num][1]);
+            splice_pipe[dev_num][0] = splice_pipe[dev_num][1] = 0;
+
+            mio_error_code = MIO_SPLICE_ERROR;
+            sprintf(mio_error_string, "MIO : Event write failed, %ld events lost\n",
+                    (long) ((val - moved) / sizeof(struct mio_event)));
+            return -1;
+        }
+    }
+
+    return val / sizeof(struct mio_event);
+}
+
+//------------------------------------------------------------------------
+//
+// mio_set_priority
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			priority	MIO_PRIO_NORMAL or MIO_PRIO_HIGH
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// The class applies to every call this process makes on the device.
+//
+//------------------------------------------------------------------------
+void mio_set_priority(int dev_num, int priority)
+{
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return;
+    }
+
+    if (priority != MIO_PRIO_NORMAL && priority != MIO_PRIO_HIGH)
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO : Bad priority %d\n", priority);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    if (ioctl(handle[dev_num], MIO_SET_PRIORITY, priority))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO : Unable to set priority %d\n", priority);
+    }
+}
+
+//------------------------------------------------------------------------
+//
+// mio_get_config
+//
+// Arguments:
+//			dev_num		The index of the chip
+//			cfg			Receives the device configuration
+//
+// Return value in mio_error_code:
+//			0	The function completes successfully
+//          any other return value indicates function failed
+//
+// Write the returned struct to /sys/class/pcmmio_ws/<device>/config to
+// apply it, or install it as /lib/firmware/<device>.cfg to have the
+// driver apply it whenever it loads.
+//
+//------------------------------------------------------------------------
+void mio_get_config(int dev_num, struct mio_config *cfg)
+{
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return;
+
+    if (ioctl(handle[dev_num], MIO_GET_CONFIG, cfg))
+    {
+        mio_error_code = MIO_BAD_VALUE;
+        sprintf(mio_error_string, "MIO : Unable to read configuration\n");
+    }
+}
+
+//------------------------------------------------------------------------
+//
+// mio_config_loaded
+//
+// Arguments:
+//			dev_num		The index of the chip
+//
+// Returns:
+//			1	The driver applied a saved configuration and the
+//				library images were seeded from it
+//			0	The device runs from its power up defaults
+//
+//------------------------------------------------------------------------
+int mio_config_loaded(int dev_num)
+{
+    mio_error_code = MIO_SUCCESS;
+
+    if (dev_num < 0 || dev_num > MAX_DEV - 1)
+    {
+        mio_error_code = MIO_BAD_DEVICE;
+        sprintf(mio_error_string, "MIO : Bad device number %d\n", dev_num);
+        return 0;
+    }
+
+    if (check_handle(dev_num))   // Check for chip available  
+        return 0;
+
+    return config_loaded[dev_num];
 }
@@ -29,6 +29,21 @@
 //	11/11/10	  1.0		Original Release	
 //	10/09/12	  3.0		Removed IOCTL_NUM		
 //	11/07/18	  4.0		Minor code clean up		
+//	10/19/26	  5.0		Added ADC_SCAN
+//                          Added DIO_ADD_RULE and DIO_CLEAR_RULES
+//                          Added ADC alarms and the event record
+//                          Added MIO_WAIT
+//                          Added MIO_SET_EVENTFD
+//                          Added asynchronous command submission
+//                          Added DIO port snapshot to events
+//                          Added quadrature decoding
+//                          Added DIO_BOTH_EDGES
+//                          Added DIO_SET_PWM
+//                          Added DIO_SCAN
+//                          Added the mmap state page
+//                          Added splice support for the event stream
+//                          Added MIO_SET_PRIORITY
+//                          Added MIO_GET_CONFIG
 //
 //****************************************************************************
 
@@ -36,6 +51,7 @@
 #define __MIO_IO_H
 
 #include <linux/ioctl.h> 
+#include <linux/types.h>
 
 #define IOCTL_NUM   'i'
 
@@ -74,6 +90,235 @@
 
 #define MIO_READ_REG 		    _IOWR(IOCTL_NUM, 17, int)
 
+#define ADC_SCAN 		        _IOWR(IOCTL_NUM, 18, struct mio_adc_scan)
+
+#define DIO_ADD_RULE 		    _IOW(IOCTL_NUM, 19, struct mio_rule)
+
+#define DIO_CLEAR_RULES 	    _IOWR(IOCTL_NUM, 20, int)
+
+#define ADC_SET_ALARM 		    _IOW(IOCTL_NUM, 21, struct mio_adc_alarm)
+
+#define ADC_MONITOR 		    _IOWR(IOCTL_NUM, 22, int)
+
+#define MIO_WAIT 		        _IOWR(IOCTL_NUM, 23, struct mio_wait)
+
+#define MIO_SET_EVENTFD 	    _IOW(IOCTL_NUM, 24, struct mio_eventfd)
+
+#define DIO_SET_QUAD 		    _IOW(IOCTL_NUM, 25, struct mio_quad)
+
+#define DIO_GET_QUAD 		    _IOR(IOCTL_NUM, 26, struct mio_quad_state)
+
+#define DIO_BOTH_EDGES 		    _IOWR(IOCTL_NUM, 27, int)
+
+#define DIO_SET_PWM 		    _IOW(IOCTL_NUM, 28, struct mio_pwm)
+
+#define DIO_SCAN 		        _IOWR(IOCTL_NUM, 29, int)
+
+#define MIO_SET_PRIORITY 	    _IOWR(IOCTL_NUM, 30, int)
+
+#define MIO_GET_CONFIG 		    _IOR(IOCTL_NUM, 31, struct mio_config)
+
+// Argument for ADC_SCAN. The driver converts every channel in the mask
+// and returns the results indexed by channel number.
+struct mio_adc_scan {
+    __u16 channels;         // bit n selects channel n (0-15)
+    __u16 flags;            // MIO_SCAN_xxx
+    __u16 data[16];
+};
+
+// Run ADC1 (channels 0-7) and ADC2 (channels 8-15) side by side, so
+// channels n and n+8 are converted at the same time
+#define MIO_SCAN_PARALLEL   0x0001
+
+// Argument for DIO_ADD_RULE. When the interrupt for a DIO bit fires on the
+// given edge the driver performs the action from its interrupt handler,
+// before the event is handed to user space.
+struct mio_rule {
+    __u8 bit;               // DIO bit number (1-24)
+    __u8 edge;              // RISING or FALLING
+    __u8 action;            // MIO_RULE_xxx
+    __u8 target;            // DIO port (0-5) or DAC channel (0-7)
+    __u8 mask;              // MIO_RULE_DIO: bits of the port to change
+    __u8 value;             // MIO_RULE_DIO: new state of those bits
+    __u16 code;             // MIO_RULE_DAC: output code to load
+};
+
+#define MIO_RULE_DIO        0   // write value under mask to a DIO port
+#define MIO_RULE_DAC        1   // load code into a DAC channel and update
+
+// Number of rules each device can hold
+#define MAX_RULES           16
+
+// Argument for ADC_SET_ALARM. Limits are compared against the conversion
+// result as returned by the ADC, signed for bipolar channels. An alarm is
+// raised when the result goes above high or below low, and cleared once it
+// has come back inside the limit by more than hysteresis.
+struct mio_adc_alarm {
+    __u8 channel;           // ADC channel (0-15)
+    __u8 mode;              // MIO_ALARM_xxx, 0 disables the alarm
+    __u16 hysteresis;
+    __s32 low;
+    __s32 high;
+};
+
+#define MIO_ALARM_HIGH      0x01
+#define MIO_ALARM_LOW       0x02
+#define MIO_ALARM_WINDOW    (MIO_ALARM_HIGH | MIO_ALARM_LOW)
+
+// Shortest period ADC_MONITOR will scan the alarm channels at
+#define MIN_MONITOR_PERIOD  10
+
+// Records returned by read() or splice() on the device file. DIO
+// interrupts, ADC alarms and command completions share one queue in the
+// order they happened.
+struct mio_event {
+    __u64 timestamp;        // CLOCK_MONOTONIC nanoseconds
+    __u8 type;              // MIO_EVENT_xxx
+    __u8 source;            // DIO bit number (1-48) or ADC channel (0-15)
+    __u16 value;            // MIO_EVENT_ADC_ALARM: conversion result
+    __u8 flags;             // MIO_EVENT_DIO: RISING or FALLING
+                            // MIO_EVENT_ADC_ALARM: MIO_ALARM_xxx now active
+    __u8 reserved[3];
+    __u8 ports[6];          // MIO_EVENT_DIO: DIO_PORT0-5 read with the event
+    __u8 reserved2[2];
+    __u64 user_data;        // MIO_EVENT_COMPLETION: from the mio_cmd
+    __s32 result;           // MIO_EVENT_COMPLETION: the ioctl return value
+    __u32 command;          // MIO_EVENT_COMPLETION: the ioctl code
+};
+
+#define MIO_EVENT_DIO           0
+#define MIO_EVENT_ADC_ALARM     1
+#define MIO_EVENT_COMPLETION    2
+
+// Commands submitted with write() on the device file. Any of the ioctls
+// above that take an int argument, except DIO_GET_INT, can be submitted.
+// Each command completes with a MIO_EVENT_COMPLETION record carrying its
+// user_data and the value the ioctl would have returned. Register
+// commands complete during the write, the *_WAIT_INT commands complete
+// from the interrupt handler when their source next interrupts, so a
+// thread can keep many waits on several cards in flight at once.
+// Completions are only read back through the file that submitted them.
+struct mio_cmd {
+    __u64 user_data;
+    __u32 command;          // ioctl code, e.g. DAC_WRITE_DATA
+    __u32 arg;              // ioctl argument
+};
+
+// Number of *_WAIT_INT commands each device can hold in flight
+#define MAX_PENDING         32
+
+// Completions each open file holds until they are read, a write stops
+// short with EBUSY rather than lose one
+#define MAX_COMPLETIONS     256
+
+// Number of quadrature channels, one per pair of DIO bits
+#define MAX_QUAD            12
+
+// Argument for DIO_SET_QUAD. The driver takes over the interrupts of both
+// bits and counts every transition of the A/B pair, so no events are
+// queued for them. Swap bit_a and bit_b to reverse the direction. A
+// bit_a of 0 turns the channel off. The position restarts at 0.
+struct mio_quad {
+    __u8 channel;           // 0 to MAX_QUAD - 1
+    __u8 bit_a;             // DIO bit number (1-24)
+    __u8 bit_b;
+    __u8 reserved;
+};
+
+// Returned by DIO_GET_QUAD, all channels read at the same instant
+struct mio_quad_state {
+    __s64 position[MAX_QUAD];
+    __u32 errors[MAX_QUAD]; // transitions that skipped a state
+};
+
+// Shortest PWM period the driver will time
+#define MIN_PWM_PERIOD      50
+
+// Argument for DIO_SET_PWM. The driver toggles the output from a timer,
+// lines on the same port that switch together share one port write. A
+// duty of 0 or of the whole period just drives the line low or high. A
+// period of 0 stops the channel and turns the output off.
+struct mio_pwm {
+    __u8 bit;               // DIO bit number (1-48)
+    __u8 reserved[3];
+    __u32 period_us;        // 0 or MIN_PWM_PERIOD and up
+    __u32 duty_us;          // time high in each period
+};
+
+// Shortest period DIO_SCAN will sample bits 25-48 at
+#define MIN_SCAN_PERIOD     50
+
+// Layout of the read only page returned by mmap() on the device file.
+// The driver makes seq odd while it updates the page and even again
+// afterwards, so a reader copies what it needs between two reads of the
+// same even seq. mio_read_state does this.
+struct mio_state {
+    __u32 seq;
+    __u32 reserved;
+    __u64 timestamp;        // CLOCK_MONOTONIC nanoseconds of the last update
+    __u8 ports[6];          // DIO_PORT0-5 as read with the last event or scan
+    __u8 outputs[6];        // DIO_PORT0-5 as last written
+    __u8 reserved2[4];
+    __u16 adc[16];          // last conversion result per channel
+    __u16 dac[8];           // code on each DAC output
+};
+
+// Priority classes for MIO_SET_PRIORITY, one per open file. While a high
+// priority file waits for the device the others hold back, and their
+// ADC scans are split so it can get in between the slices.
+#define MIO_PRIO_NORMAL     0
+#define MIO_PRIO_HIGH       1
+
+// Card setup held by the driver. MIO_GET_CONFIG and the sysfs attribute
+// "config" return the live setup, writing the attribute or installing it
+// as firmware file pcmmio_ws<x>.cfg applies it.
+#define MIO_CONFIG_MAGIC    0x4d494f31  // "MIO1"
+#define MIO_CONFIG_APPLIED  0x0001      // a saved setup was applied
+
+struct mio_config {
+    __u32 magic;            // MIO_CONFIG_MAGIC
+    __u32 flags;            // MIO_CONFIG_xxx
+    __u8 adc_mode[16];      // ADC command byte per channel
+    __u8 dac_span[8];       // DAC_SPAN_xxx per channel, 0xff not set
+    __u8 dio_ports[6];      // DIO_PORT0-5 output images
+    __u8 dio_polarity[3];   // polarity registers, a set bit selects FALLING
+    __u8 dio_enable[3];     // DIO_ENABLE0-2 interrupt enables
+};
+
+// Sources for MIO_WAIT. The first five follow the bit layout of the
+// interrupt ID register.
+#define MIO_SRC_ADC1        0x01
+#define MIO_SRC_ADC2        0x02
+#define MIO_SRC_DAC1        0x04
+#define MIO_SRC_DIO         0x08
+#define MIO_SRC_DAC2        0x10
+#define MIO_SRC_ALARM       0x20
+
+#define MIO_SOURCES         6
+
+// Argument for MIO_WAIT. The driver keeps a completion counter per source
+// and returns once any selected counter differs from the one passed in,
+// so a caller that hands back the counters from its previous call never
+// misses a completion that happened in between.
+struct mio_wait {
+    __u32 mask;             // in: MIO_SRC_xxx to wait for
+    __u32 timeout_ms;       // in: 0 waits forever
+    __u32 ready;            // out: sources whose counter moved
+    __u32 count[MIO_SOURCES];   // in/out: completion counters
+};
+
+// Argument for MIO_SET_EVENTFD. The eventfd is signalled from the
+// interrupt handler with the number of completions of the selected
+// sources. Binding the same eventfd again replaces its mask, a mask of 0
+// unbinds it. Bindings are dropped when the device file is closed.
+struct mio_eventfd {
+    __s32 fd;
+    __u32 mask;             // MIO_SRC_xxx
+};
+
+// Number of eventfds each device can signal
+#define MAX_EVENTFDS        8
+
 // The name of the device file
 #define DEVICE_FILE_NAME "pcmmio_ws"
 
@@ -92,6 +337,7 @@
 #define MIO_BAD_DEVICE            11
 #define MIO_BAD_CHIP_NUM          12
 #define MIO_NULL_POINTER          13
+#define MIO_SPLICE_ERROR          14
 
 // register map
 #define ADC1_DATA_LO    0
@@ -195,6 +441,7 @@
 // These are DIO specific defines
 #define FALLING    1
 #define RISING     0
+#define BOTH_EDGES 2
 
 #ifdef LIB_DEFINED
 
@@ -252,6 +499,9 @@ float adc_auto_get_channel_voltage(int dev_num, int channel);
 void adc_disable_interrupt(int dev_num, int adc_num);
 void adc_enable_interrupt(int dev_num, int adc_num);
 void adc_wait_int(int dev_num, int adc_num);
+void adc_scan_channels(int dev_num, unsigned short channels, int flags, unsigned short *buffer);
+void adc_set_alarm(int dev_num, int channel, int mode, int low, int high, unsigned short hysteresis);
+void adc_start_monitor(int dev_num, int period_ms);
 
 // dac functions
 void dac_set_span(int dev_num, int channel, unsigned char span_value);
@@ -279,8 +529,25 @@ void dio_disab_bit_int(int dev_num, int bit_number);
 void dio_clr_int(int dev_num, int bit_number);
 int dio_get_int(int dev_num);
 int dio_wait_int(int dev_num);
+int dio_add_output_rule(int dev_num, int bit_number, int edge, int port, unsigned char mask, unsigned char value);
+int dio_add_dac_rule(int dev_num, int bit_number, int edge, int channel, unsigned short dac_value);
+void dio_clear_rules(int dev_num);
+void dio_set_quadrature(int dev_num, int channel, int bit_a, int bit_b);
+void dio_read_quadrature(int dev_num, long long *positions, unsigned int *errors);
+void dio_set_pwm(int dev_num, int bit_number, unsigned int period_us, unsigned int duty_us);
+void dio_scan_ports(int dev_num, unsigned int period_us);
 
 // misc functions
+int mio_read_event(int dev_num, struct mio_event *event);
+int mio_wait_sources(int dev_num, int mask, int timeout_ms, unsigned int *counts);
+void mio_set_eventfd(int dev_num, int fd, int mask);
+int mio_submit(int dev_num, struct mio_cmd *cmds, int count);
+const volatile struct mio_state *mio_map_state(int dev_num);
+void mio_read_state(int dev_num, struct mio_state *state);
+int mio_splice_events(int dev_num, int fd, int count);
+void mio_set_priority(int dev_num, int priority);
+void mio_get_config(int dev_num, struct mio_config *cfg);
+int mio_config_loaded(int dev_num);
 unsigned char mio_read_reg(int dev_num, int offset);
 void mio_write_reg(int dev_num, int offset, unsigned char value);
 
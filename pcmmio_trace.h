@@ -0,0 +1,285 @@
+//****************************************************************************
+//
+//	Copyright 2026 by WinSystems Inc.
+//
+//	Permission is hereby granted to the purchaser of WinSystems GPIO cards
+//	and CPU products incorporating a GPIO device, to distribute any binary
+//	file or files compiled using this source code directly or in any work
+//	derived by the user from this file. In no case may the source code,
+//	original or derived from this file, be distributed to any third party
+//	except by explicit permission of WinSystems. This file is distributed
+//	on an "As-is" basis and no warranty as to performance or fitness of pur-
+//	poses is expressed or implied. In no case shall WinSystems be liable for
+//	any direct or indirect loss or damage, real or consequential resulting
+//	from the usage of this source code. It is the user's sole responsibility
+//	to determine fitness for any considered purpose.
+//
+//****************************************************************************
+//
+//	Name	 : pcmmio_trace.h
+//
+//	Project	 : PCMMIO Linux Device Driver
+//
+//	Author	 : Paul DeMetrotion
+//
+//****************************************************************************
+//
+//	  Date		Revision	                Description
+//	--------	--------	---------------------------------------------
+//	10/19/26	  5.0		Original Release
+//
+//****************************************************************************
+
+// Kernel tracepoints for the pcmmio_ws driver. The events are grouped
+// under the "pcmmio_ws" system and can be enabled with trace-cmd, perf
+// or directly from /sys/kernel/debug/tracing/events/pcmmio_ws. When they
+// are disabled each call site costs a single patched-out branch.
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pcmmio_ws
+
+#if !defined(__PCMMIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __PCMMIO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Entry into irq_handler with the raw DAC2_IRQ_REG contents */
+TRACE_EVENT(pcmmio_irq,
+    TP_PROTO(const char *name, unsigned char status),
+    TP_ARGS(name, status),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned char, status)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->status = status;
+    ),
+
+    TP_printk("%s status=%02x", __get_str(name), __entry->status)
+);
+
+/* One DIO interrupt decoded by get_int and queued in the event ring */
+TRACE_EVENT(pcmmio_dio_event,
+    TP_PROTO(const char *name, int bit, int depth),
+    TP_ARGS(name, bit, depth),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, bit)
+        __field(int, depth)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->bit = bit;
+        __entry->depth = depth;
+    ),
+
+    TP_printk("%s bit=%d depth=%d", __get_str(name), __entry->bit,
+              __entry->depth)
+);
+
+/* One DIO event removed from the event ring by a reader */
+TRACE_EVENT(pcmmio_dio_dequeue,
+    TP_PROTO(const char *name, int bit, int depth),
+    TP_ARGS(name, bit, depth),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, bit)
+        __field(int, depth)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->bit = bit;
+        __entry->depth = depth;
+    ),
+
+    TP_printk("%s bit=%d depth=%d", __get_str(name), __entry->bit,
+              __entry->depth)
+);
+
+/* An in-kernel ADC scan finished */
+TRACE_EVENT(pcmmio_adc_scan,
+    TP_PROTO(const char *name, int count, int ret),
+    TP_ARGS(name, count, ret),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, count)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s channels=%d ret=%d", __get_str(name), __entry->count,
+              __entry->ret)
+);
+
+/* An ADC channel crossed an alarm limit, state 0 means it cleared */
+TRACE_EVENT(pcmmio_adc_alarm,
+    TP_PROTO(const char *name, int channel, unsigned short value, int state),
+    TP_ARGS(name, channel, value, state),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, channel)
+        __field(unsigned short, value)
+        __field(int, state)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->channel = channel;
+        __entry->value = value;
+        __entry->state = state;
+    ),
+
+    TP_printk("%s channel=%d value=%04x state=%d", __get_str(name),
+              __entry->channel, __entry->value, __entry->state)
+);
+
+/* An output rule fired from irq_handler */
+TRACE_EVENT(pcmmio_rule,
+    TP_PROTO(const char *name, int bit, int rule),
+    TP_ARGS(name, bit, rule),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, bit)
+        __field(int, rule)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->bit = bit;
+        __entry->rule = rule;
+    ),
+
+    TP_printk("%s bit=%d rule=%d", __get_str(name), __entry->bit,
+              __entry->rule)
+);
+
+/* A DIO bit was masked for storming (active=1) or got its interrupt back */
+TRACE_EVENT(pcmmio_storm,
+    TP_PROTO(const char *name, int bit, int active),
+    TP_ARGS(name, bit, active),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, bit)
+        __field(int, active)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->bit = bit;
+        __entry->active = active;
+    ),
+
+    TP_printk("%s bit=%d active=%d", __get_str(name), __entry->bit,
+              __entry->active)
+);
+
+/* Waiters on the device wait queue are being woken */
+TRACE_EVENT(pcmmio_wakeup,
+    TP_PROTO(const char *name, unsigned char status),
+    TP_ARGS(name, status),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned char, status)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->status = status;
+    ),
+
+    TP_printk("%s status=%02x", __get_str(name), __entry->status)
+);
+
+/* A buffered IIO scan was pushed to the kfifo, or failed with ret */
+TRACE_EVENT(pcmmio_buffer_push,
+    TP_PROTO(const char *name, unsigned long seq, int count, int ret),
+    TP_ARGS(name, seq, count, ret),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned long, seq)
+        __field(int, count)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->seq = seq;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%s seq=%lu channels=%d ret=%d", __get_str(name),
+              __entry->seq, __entry->count, __entry->ret)
+);
+
+TRACE_EVENT(pcmmio_ioctl_enter,
+    TP_PROTO(const char *name, unsigned int cmd, unsigned long param),
+    TP_ARGS(name, cmd, param),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned int, cmd)
+        __field(unsigned long, param)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->cmd = cmd;
+        __entry->param = param;
+    ),
+
+    TP_printk("%s cmd=%u param=%lx", __get_str(name),
+              _IOC_NR(__entry->cmd), __entry->param)
+);
+
+/* Total time spent in device_ioctl, including any lock wait */
+TRACE_EVENT(pcmmio_ioctl_exit,
+    TP_PROTO(const char *name, unsigned int cmd, long ret, u64 duration),
+    TP_ARGS(name, cmd, ret, duration),
+
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(unsigned int, cmd)
+        __field(long, ret)
+        __field(u64, duration)
+    ),
+
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->cmd = cmd;
+        __entry->ret = ret;
+        __entry->duration = duration;
+    ),
+
+    TP_printk("%s cmd=%u ret=%ld duration=%lluns", __get_str(name),
+              _IOC_NR(__entry->cmd), __entry->ret,
+              (unsigned long long) __entry->duration)
+);
+
+#endif /* __PCMMIO_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE pcmmio_trace
+
+#include <trace/define_trace.h>
@@ -32,6 +32,31 @@
 //	10/09/12	  3.1		Renamed file to pcmmio_ws
 //	11/07/18	  4.0		Upgraded to support Linux 4.x kernels
 //                          Improved ISR performance		
+//	10/19/26	  5.0		Added kernel tracepoints
+//                          Added DIO wakeup latency histogram
+//                          Added per-ioctl service time histograms
+//                          Added simulated hardware backend
+//                          Added gpiolib and irqchip support for DIO
+//                          Added IIO driver for the ADC channels
+//                          Added parallel ADC scanning
+//                          Added DIO interrupt output rules
+//                          Added ADC alarm monitor and event read
+//                          Added multi-source wait
+//                          Added eventfd notification
+//                          Added asynchronous command submission
+//                          Added timed polling for cards without an IRQ
+//                          Added DIO interrupt storm mitigation
+//                          Added DIO port snapshot to events
+//                          Added quadrature decoding
+//                          Added both edge DIO interrupts
+//                          Added software PWM
+//                          Added DIO port scanning
+//                          Added mmap state page
+//                          Added flight recorder
+//                          Added splice_read
+//                          Added per file priority classes
+//                          Added shared IRQ dispatcher
+//                          Added persistent device configuration
 //
 //****************************************************************************
 
@@ -47,20 +72,117 @@
 #include <linux/cdev.h>
 #include <linux/io.h>
 #include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/eventfd.h>
+#include <linux/percpu.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/firmware.h>
+#include <linux/gpio/driver.h>
+#include <linux/irq.h>
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#include <asm/local.h>
 
 #include "mio_io.h"
 
+#define CREATE_TRACE_POINTS
+#include "pcmmio_trace.h"
+
 #define MOD_DESC "WinSystems, Inc. PCM-MIO-G Driver"
 MODULE_LICENSE("GPL v2");
 MODULE_DESCRIPTION(MOD_DESC);
 MODULE_AUTHOR("Paul DeMetrotion");
 
+// Log2 latency histogram, bucket n counts values in [2^(n-1), 2^n) ns
+#define HIST_BUCKETS 32
+
+struct pcmmio_hist {
+    atomic_long_t bucket[HIST_BUCKETS];
+    atomic64_t sum;
+    atomic64_t max;
+};
+
+// Ioctl command numbers tracked by the per-ioctl statistics
+#define IOCTL_STATS 32
+
+struct pcmmio_ioctl_stats {
+    struct pcmmio_hist lock_wait;
+    struct pcmmio_hist service;
+};
+
+// Flight recorder entries kept per CPU, must be a power of 2
+#define FLIGHT_RECORDS 512
+
+struct pcmmio_record {
+    u64 timestamp;
+    u8 type;                // FLIGHT_xxx
+    u8 reg;                 // register offset, ioctl number or DIO bit
+    u16 reserved;
+    u32 value;
+};
+
+struct pcmmio_flight {
+    local_t head;
+    struct pcmmio_record rec[FLIGHT_RECORDS];
+};
+
+#define FLIGHT_OUTB     0   // register write, byte
+#define FLIGHT_OUTW     1   // register write, word
+#define FLIGHT_IOCTL    2   // ioctl number and argument
+#define FLIGHT_IRQ      3   // interrupt ID register contents
+#define FLIGHT_DIO      4   // DIO event bit and edge
+
+// An eventfd bound with MIO_SET_EVENTFD and the file that bound it
+struct pcmmio_eventfd {
+    struct eventfd_ctx *ctx;
+    struct file *owner;
+    u32 mask;
+};
+
+// A *_WAIT_INT command submitted with write() that has not completed yet
+struct pcmmio_pending {
+    struct file *owner;
+    u64 user_data;
+    u32 command;
+    unsigned char source;
+};
+
+// A quadrature channel decoded by the ISR, bits are 0 based
+struct pcmmio_quad {
+    unsigned char bit_a, bit_b;
+    unsigned char state;
+    s64 position;
+    u32 errors;
+};
+
+struct pcmmio_pwm {
+    u64 start;              // time the first period began
+    u64 period;
+    u64 high;
+    u64 next;               // time of the next edge
+};
+
+struct pcmmio_sim;
+
 struct pcmmio_device {
     char name[32];
     unsigned short irq;
     struct cdev cdev;
     unsigned base_port;
-    unsigned char int_buffer[MAX_INTS];
+    struct pcmmio_sim *sim;
+    struct mio_event int_buffer[MAX_INTS];
     int inptr;
     int outptr;
     wait_queue_head_t wq;
@@ -70,13 +192,247 @@ struct pcmmio_device {
     unsigned char port_images[6];
     struct mutex mtx;
     spinlock_t spnlck;
+    spinlock_t isr_lock;            // irq_service against the sampling timers
+    struct dentry *debug_dir;
+    struct pcmmio_hist wake_latency;
+    struct pcmmio_ioctl_stats ioctl_stats[IOCTL_STATS];
+    unsigned long irq_count;
+    unsigned long events_dropped;
+    struct device *dev;
+#ifdef CONFIG_GPIOLIB
+    struct gpio_chip gpio;
+    struct irq_chip gpio_irq;
+    unsigned long gpio_irq_enabled;
+    bool gpio_registered;
+#endif
+    unsigned char adc_mode[16];
+    struct iio_dev *iio;
+    struct mio_rule rules[MAX_RULES];
+    int rule_count;
+    u32 rule_bits;
+    unsigned long rules_fired;
+    struct mio_adc_alarm alarms[16];
+    unsigned char alarm_state[16];
+    unsigned short alarm_mask;
+    unsigned monitor_ms;
+    struct delayed_work monitor;
+    unsigned long alarms_raised;
+    unsigned int completions[MIO_SOURCES];
+    struct pcmmio_eventfd eventfds[MAX_EVENTFDS];
+    u32 eventfd_mask;
+    struct pcmmio_pending pending[MAX_PENDING];
+    u32 pending_mask;
+    struct hrtimer poll_timer;
+    ktime_t poll_period;
+    unsigned long polls;
+    bool storm_polling;
+    bool stopping;                  // unloading, storms may not arm poll_timer
+    u32 storm_mask;
+    u32 storm_level;
+    u32 storm_polarity;
+    u64 storm_window;
+    unsigned short storm_hits[24];
+    u64 storm_start[24];
+    unsigned short storm_edges[24];
+    unsigned long storms;
+    unsigned long storm_recoveries;
+    unsigned long storm_polled;
+    struct pcmmio_quad quad[MAX_QUAD];
+    u32 quad_bits;
+    unsigned char quad_map[24];
+    u32 both_edges;
+    struct pcmmio_pwm pwm[48];
+    u64 pwm_bits;
+    struct hrtimer pwm_timer;
+    unsigned long pwm_edges;
+    unsigned long pwm_writes;
+    struct hrtimer scan_timer;
+    ktime_t scan_period;
+    u32 scan_level;
+    unsigned long scans;
+    unsigned long scan_changes;
+    struct mio_state *state;
+    unsigned char adc_last[2];
+    unsigned char adc_prev[2];
+    unsigned short dac_data[2];     // last DAC_WRITE_DATA, restored after a rule
+    unsigned short dac_b1[8];
+    struct pcmmio_flight __percpu *flight;
+    atomic_t hp_waiting;
+    atomic_t hp_clients;
+    wait_queue_head_t prio_wq;
+    unsigned long yields;
+    unsigned char dac_span[8];
+    bool config_applied;
+};
+
+// Per open file state, kept in file->private_data
+struct pcmmio_file {
+    struct pcmmio_device *pmdev;
+    int priority;           // MIO_PRIO_xxx
+    struct mio_event done[MAX_COMPLETIONS];     // completions of our commands
+    int done_in;
+    int done_out;
 };
 
+static inline struct pcmmio_device *file_pmdev(struct file *file)
+{
+    return ((struct pcmmio_file *) file->private_data)->pmdev;
+}
+
+// Default ADC command for a channel until somebody selects another mode
+#define ADC_DEFAULT_MODE (ADC_SINGLE_ENDED | ADC_BIPOLAR | ADC_TOP_10V)
+
+// Status register polls before an ADC conversion is declared lost
+#define ADC_RETRY 10000
+
+// Channels per slice of a normal priority scan while a high priority file
+// is open
+#define ADC_SCAN_SLICE 4
+
+// Status register polls before a rule gives up waiting on a busy DAC
+#define RULE_DAC_RETRY 100
+
 // Function prototypes for local functions
-static int get_buffered_int(struct pcmmio_device *pmdev);
+static bool __queue_event(struct pcmmio_device *pmdev, const struct mio_event *ev);
+static bool queue_event(struct pcmmio_device *pmdev, const struct mio_event *ev);
+static bool dequeue_event(struct pcmmio_device *pmdev, struct mio_event *ev);
+static int get_buffered_int(struct pcmmio_device *pmdev, u64 *stamp);
+static void eventfd_notify(struct pcmmio_device *pmdev, u32 sources);
+static void eventfd_release(struct pcmmio_device *pmdev, struct file *file);
+static int cmd_wait_source(unsigned int command);
+static bool cmd_immediate(unsigned int command);
+static bool cmd_park(struct pcmmio_device *pmdev, struct file *file, const struct mio_cmd *cmd, int source);
+static void cmd_complete(struct pcmmio_device *pmdev, int source, int result);
+static void cmd_release(struct pcmmio_device *pmdev, struct file *file);
+static bool cmd_room(struct pcmmio_device *pmdev, struct file *file);
+static void cmd_post(struct pcmmio_device *pmdev, struct file *file, const struct mio_event *ev);
+static bool cmd_dequeue(struct pcmmio_file *pf, struct mio_event *ev);
+static void poll_init(struct pcmmio_device *pmdev);
+static void poll_start(struct pcmmio_device *pmdev, unsigned period_us);
+static void poll_stop(struct pcmmio_device *pmdev);
+static void storm_account(struct pcmmio_device *pmdev, int bit_number);
+static int quad_set(struct pcmmio_device *pmdev, const struct mio_quad *cfg);
+static void quad_update(struct pcmmio_device *pmdev, int bit_number);
+static void quad_get(struct pcmmio_device *pmdev, struct mio_quad_state *state);
+static void pwm_init(struct pcmmio_device *pmdev);
+static int pwm_set(struct pcmmio_device *pmdev, const struct mio_pwm *cfg);
+static void pwm_stop(struct pcmmio_device *pmdev);
+static void scan_init(struct pcmmio_device *pmdev);
+static void scan_start(struct pcmmio_device *pmdev, unsigned period_us);
+static void scan_stop(struct pcmmio_device *pmdev);
+static void state_outputs(struct pcmmio_device *pmdev);
+static void state_inputs(struct pcmmio_device *pmdev, const unsigned char *ports);
+static void state_port(struct pcmmio_device *pmdev, int port, unsigned char val);
+static void state_adc(struct pcmmio_device *pmdev, const unsigned char *channels, int count, const unsigned short *data);
+static void state_dac(struct pcmmio_device *pmdev, int dac, unsigned char command, unsigned short data);
 static void init_io(struct pcmmio_device *pmdev, unsigned io_address);
+static void init_irq(struct pcmmio_device *pmdev, unsigned char irq_num);
+static void dio_write_port(struct pcmmio_device *pmdev, int port, unsigned char val);
+static void gpio_init(struct pcmmio_device *pmdev);
+static void gpio_exit(struct pcmmio_device *pmdev);
+static void gpio_handle_int(struct pcmmio_device *pmdev, int bit_number);
+static void iio_init(struct pcmmio_device *pmdev);
+static void iio_exit(struct pcmmio_device *pmdev);
+static int adc_scan(struct pcmmio_device *pmdev, const unsigned char *channels, int count, unsigned short *data);
+static int adc_scan_parallel(struct pcmmio_device *pmdev, const unsigned char *channels, int count, unsigned short *data);
+static int adc_scan_sliced(struct pcmmio_device *pmdev, const unsigned char *channels, int count,
+                           unsigned short *data, bool parallel, bool sliced);
+static void adc_monitor_work(struct work_struct *work);
 static void clr_int(struct pcmmio_device *pmdev, int bit_number);
 static int get_int(struct pcmmio_device *pmdev);
+static int dio_take_edge(struct pcmmio_device *pmdev, int bit_number);
+static int dio_both_edges(struct pcmmio_device *pmdev, int bit, bool enable);
+static void run_rules(struct pcmmio_device *pmdev, int bit_number, int edge);
+static void hist_add(struct pcmmio_hist *hist, u64 value);
+static void debugfs_create_hist(const char *name, struct dentry *parent, struct pcmmio_hist *hist);
+static void debugfs_create_ioctl_stats(struct pcmmio_device *pmdev);
+static void debugfs_create_counters(struct pcmmio_device *pmdev);
+static int sim_init(struct pcmmio_device *pmdev, unsigned rate);
+static void sim_start(struct pcmmio_device *pmdev);
+static void sim_stop(struct pcmmio_device *pmdev);
+static void sim_exit(struct pcmmio_device *pmdev);
+static void sim_show_counters(struct seq_file *m, struct pcmmio_device *pmdev);
+static unsigned char sim_inb(struct pcmmio_device *pmdev, unsigned reg);
+static void sim_outb(struct pcmmio_device *pmdev, unsigned char val, unsigned reg);
+static unsigned short sim_inw(struct pcmmio_device *pmdev, unsigned reg);
+static void sim_outw(struct pcmmio_device *pmdev, unsigned short val, unsigned reg);
+static void debugfs_create_flight(struct pcmmio_device *pmdev);
+static void config_load(struct pcmmio_device *pmdev);
+static void config_snapshot(struct pcmmio_device *pmdev, struct mio_config *cfg);
+static struct bin_attribute config_attr;
+
+/* Append one record to this CPU's flight recorder ring */
+static inline void flight_record(struct pcmmio_device *pmdev, u8 type, u8 reg, u32 value)
+{
+    struct pcmmio_flight *flight;
+    struct pcmmio_record *rec;
+
+    if (unlikely(!pmdev->flight))
+        return;
+
+    // local_t makes the slot ours even if an interrupt records meanwhile
+    flight = get_cpu_ptr(pmdev->flight);
+    rec = &flight->rec[(local_inc_return(&flight->head) - 1) & (FLIGHT_RECORDS - 1)];
+
+    rec->timestamp = ktime_get_ns();
+    rec->type = type;
+    rec->reg = reg;
+    rec->value = value;
+
+    put_cpu_ptr(pmdev->flight);
+}
+
+// Register accessors. All hardware access goes through these so that a
+// device can be backed by the simulated register model instead of the bus.
+static inline unsigned char mio_inb(struct pcmmio_device *pmdev, unsigned reg)
+{
+    if (unlikely(pmdev->sim))
+        return sim_inb(pmdev, reg);
+
+    return inb(pmdev->base_port + reg);
+}
+
+/* Byte write that is not recorded, for the high rate PWM port updates */
+static inline void __mio_outb(struct pcmmio_device *pmdev, unsigned char val, unsigned reg)
+{
+    if (unlikely(pmdev->sim))
+        sim_outb(pmdev, val, reg);
+    else
+        outb(val, pmdev->base_port + reg);
+}
+
+static inline void mio_outb(struct pcmmio_device *pmdev, unsigned char val, unsigned reg)
+{
+    flight_record(pmdev, FLIGHT_OUTB, reg, val);
+    __mio_outb(pmdev, val, reg);
+}
+
+static inline unsigned short mio_inw(struct pcmmio_device *pmdev, unsigned reg)
+{
+    if (unlikely(pmdev->sim))
+        return sim_inw(pmdev, reg);
+
+    return inw(pmdev->base_port + reg);
+}
+
+static inline void mio_outw(struct pcmmio_device *pmdev, unsigned short val, unsigned reg)
+{
+    flight_record(pmdev, FLIGHT_OUTW, reg, val);
+
+    if (unlikely(pmdev->sim))
+        sim_outw(pmdev, val, reg);
+    else
+        outw(val, pmdev->base_port + reg);
+}
+
+/* Channel number (0-7) encoded in an ADC command byte */
+#define ADC_CHANNEL(__cmd) ((((__cmd) >> 3) & 0x6) | (((__cmd) >> 6) & 0x1))
+
+/* Number of DIO events waiting in the ring buffer */
+#define PCMMIO_INT_DEPTH(__d) (((__d)->inptr - (__d)->outptr + MAX_INTS) % MAX_INTS)
+
+/* Number of completions waiting for a file */
+#define PCMMIO_DONE_DEPTH(__f) (((__f)->done_in - (__f)->done_out + MAX_COMPLETIONS) % MAX_COMPLETIONS)
 
 // ******************* Device Declarations *****************************
 
@@ -86,96 +442,382 @@ static int pcmmio_ws_major;
 // Our modprobe command line arguments
 static unsigned short io[MAX_DEV];
 static unsigned short irq[MAX_DEV];
+static bool sim[MAX_DEV];
+static unsigned sim_rate[MAX_DEV];
+static unsigned poll_us[MAX_DEV];
+static unsigned scan_us[MAX_DEV];
+static unsigned storm_rate = 10000;
 
 module_param_array(io, ushort, NULL, S_IRUGO);
 module_param_array(irq, ushort, NULL, S_IRUGO);
+module_param_array(sim, bool, NULL, S_IRUGO);
+MODULE_PARM_DESC(sim, "Back the device with a simulated register model, no card required");
+module_param_array(sim_rate, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(sim_rate, "Synthetic DIO edges per second generated by a simulated device, at most 20000");
+module_param_array(poll_us, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(poll_us, "Interrupt polling period in microseconds for a device loaded with irq=0, at least 50");
+module_param_array(scan_us, uint, NULL, S_IRUGO);
+MODULE_PARM_DESC(scan_us, "Change detection period in microseconds for DIO bits 25-48, 0 disables");
+module_param(storm_rate, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(storm_rate, "DIO interrupts per second on one bit before it is masked and polled, 0 disables and unmasks");
 
 /* Device structs */
 struct pcmmio_device pcmmio_devs[MAX_DEV];
 
 static struct class *pcmmio_class;
 static dev_t pcmmio_devno;
+static struct dentry *pcmmio_debug_root;
 
 
-/* Interrupt Service Routine */
-static irqreturn_t irq_handler(int __irq, void *dev_id)
+/* Run the rules for a DIO edge and queue its event */
+static void dio_dispatch(struct pcmmio_device *pmdev, int bit_number, int edge)
 {
-    struct pcmmio_device *pmdev = dev_id;
-    unsigned char status, int_num;
+    struct mio_event ev = { 0 };
     int i;
 
-    /* Read the interrupt ID register from ADC2. */
-    status = inb(pmdev->base_port + DAC2_IRQ_REG);
+    // Interlocks first, the event is queued afterwards. Rules only exist
+    // for the interrupt bits, scanned bits go straight to the ring.
+    if (bit_number <= 24 && (pmdev->rule_bits & (1 << (bit_number - 1))))
+        run_rules(pmdev, bit_number, edge);
+
+    ev.timestamp = ktime_get_ns();
+    ev.type = MIO_EVENT_DIO;
+    ev.source = bit_number;
+    ev.flags = edge;
+
+    // Capture the whole I/O state now rather than have the reader ask
+    // for it later, any outputs a rule just changed are included
+    for (i = 0; i < 6; i++)
+        ev.ports[i] = mio_inb(pmdev, DIO_PORT0 + i);
 
-    //pr_devel("interrupt register %02x\n", status);
+    state_inputs(pmdev, ev.ports);
+
+    flight_record(pmdev, FLIGHT_DIO, bit_number, edge);
+
+    if (queue_event(pmdev, &ev))
+        trace_pcmmio_dio_event(pmdev->name, bit_number, PCMMIO_INT_DEPTH(pmdev));
+}
+
+// Service the sources pending in the interrupt ID register of one card.
+// isr_lock makes the card's interrupt, poll and scan paths take turns, the
+// completion counters, rules and parked commands see one of them at a time.
+static irqreturn_t irq_service(struct pcmmio_device *pmdev, unsigned char status)
+{
+    unsigned char int_num = 0;
+    unsigned long flags;
+    int i;
+
+    trace_pcmmio_irq(pmdev->name, status);
+
+    flight_record(pmdev, FLIGHT_IRQ, 0, status);
+
+    spin_lock_irqsave(&pmdev->isr_lock, flags);
+
+    pmdev->irq_count++;
 
     /* Check the interrupts */
     for (i = 0; i < 5; i++) {
         if (!(status & (1 << i)))
             continue;
 
+        // Counters for MIO_WAIT, indexed like the status bits
+        pmdev->completions[i]++;
+
         switch (i) {
             case 0: /* ADC 1 */
-                inb(pmdev->base_port + ADC1_DATA_HI);
+                mio_inb(pmdev, ADC1_DATA_HI);
                 pmdev->ready_adc_1 = 1;
                 break;
 
             case 1: /* ADC 2 */
-                inb(pmdev->base_port + ADC2_DATA_HI);
+                mio_inb(pmdev, ADC2_DATA_HI);
                 pmdev->ready_adc_2 = 1;
                 break;
 
             case 2: /* DAC 1 */
-                inb(pmdev->base_port + DAC1_DATA_HI);
+                mio_inb(pmdev, DAC1_DATA_HI);
                 pmdev->ready_dac_1 = 1;
                 break;
 
             case 3: /* DIO */
                 int_num = get_int(pmdev);
 
-                if (int_num) {
-                    //pr_devel("Buffering DIO interrupt on bit %d\n", int_num);
-                    pmdev->int_buffer[pmdev->inptr++] = int_num;
-
-                    if (pmdev->inptr == MAX_INTS)
-                        pmdev->inptr = 0;
+                if (int_num && (pmdev->quad_bits & (1 << (int_num - 1)))) {
+                    // Encoder edges are only counted, nobody is woken
+                    quad_update(pmdev, int_num);
+                    clr_int(pmdev, int_num);
+                } else if (int_num) {
+                    dio_dispatch(pmdev, int_num, dio_take_edge(pmdev, int_num));
 
                     clr_int(pmdev, int_num);
+
+                    gpio_handle_int(pmdev, int_num);
+
+                    if (storm_rate)
+                        storm_account(pmdev, int_num);
                 }
 
                 pmdev->ready_dio = 1;
                 break;
 
             case 4: /* DAC 2 */
-                inb(pmdev->base_port + DAC2_DATA_HI);
+                mio_inb(pmdev, DAC2_DATA_HI);
                 pmdev->ready_dac_2 = 1;
                 break;
             }
+
+        // Submitted waits complete with what the ioctl would return
+        if (pmdev->pending_mask & (1 << i))
+            cmd_complete(pmdev, i, i == 3 ? int_num : 0);
     }
 
+    spin_unlock_irqrestore(&pmdev->isr_lock, flags);
+
     /* Notify waiters that an event may be of interest to them. */
+    if (pmdev->eventfd_mask & status & 0x1F)
+        eventfd_notify(pmdev, status & 0x1F);
+
+    trace_pcmmio_wakeup(pmdev->name, status);
     wake_up_all(&pmdev->wq);
 
-    if ((status & 0x1F) == 0)
+    if ((status & 0x1F) == 0) {
         pr_devel("unknown interrupt\n");
+        return IRQ_NONE;
+    }
 
     return IRQ_HANDLED;
 }
 
+/* Interrupt Service Routine for one card, used by the poll and sim timers */
+static irqreturn_t irq_handler(int __irq, void *dev_id)
+{
+    struct pcmmio_device *pmdev = dev_id;
+
+    /* Read the interrupt ID register from ADC2. */
+    return irq_service(pmdev, mio_inb(pmdev, DAC2_IRQ_REG));
+}
+
+// Cards that share an IRQ line are served by one handler per line. It reads
+// each card's interrupt ID register and services only the cards with
+// something pending, so the kernel sees IRQ_NONE for interrupts that were
+// not ours. ISA interrupts are edge triggered, a card that asserts while
+// another is being serviced raises no new edge, so the cards are scanned
+// again until a pass finds all of them quiet.
+
+// Scans of the cards on a line before the handler gives up
+#define IRQ_DISPATCH_PASSES 8
+
+struct pcmmio_irq_line {
+    unsigned irq;
+    int count;
+    struct pcmmio_device *devs[MAX_DEV];
+};
+
+static struct pcmmio_irq_line irq_lines[MAX_DEV];
+
+static irqreturn_t irq_dispatch(int __irq, void *dev_id)
+{
+    struct pcmmio_irq_line *line = dev_id;
+    struct pcmmio_device *pmdev;
+    irqreturn_t ret = IRQ_NONE;
+    unsigned char status;
+    int pass, i, count;
+    bool pending;
+
+    count = READ_ONCE(line->count);
+    smp_rmb();
+
+    for (pass = 0; pass < IRQ_DISPATCH_PASSES; pass++) {
+        pending = false;
+
+        for (i = 0; i < count; i++) {
+            pmdev = line->devs[i];
+            status = mio_inb(pmdev, DAC2_IRQ_REG);
+
+            if (!(status & 0x1F))
+                continue;
+
+            irq_service(pmdev, status);
+            pending = true;
+        }
+
+        if (!pending)
+            break;
+
+        ret = IRQ_HANDLED;
+    }
+
+    return ret;
+}
+
+/* Add a card to the handler of its IRQ line, registering the line first */
+static int irq_attach(struct pcmmio_device *pmdev, unsigned irq)
+{
+    struct pcmmio_irq_line *line = NULL;
+    int i, ret;
+
+    for (i = 0; i < MAX_DEV && !line; i++)
+        if (irq_lines[i].count && irq_lines[i].irq == irq)
+            line = &irq_lines[i];
+
+    if (line) {
+        line->devs[line->count] = pmdev;
+        smp_wmb();
+        WRITE_ONCE(line->count, line->count + 1);
+
+        pmdev->irq = irq;
+
+        return 0;
+    }
+
+    for (i = 0; i < MAX_DEV && !line; i++)
+        if (!irq_lines[i].count)
+            line = &irq_lines[i];
+
+    line->irq = irq;
+    line->devs[0] = pmdev;
+    line->count = 1;
+
+    ret = request_irq(irq, irq_dispatch, IRQF_SHARED, KBUILD_MODNAME, line);
+    if (ret) {
+        line->count = 0;
+        return ret;
+    }
+
+    pmdev->irq = irq;
+
+    return 0;
+}
+
+/* Take a card off its IRQ line, the line is released with its last card */
+static void irq_detach(struct pcmmio_device *pmdev)
+{
+    struct pcmmio_irq_line *line;
+    int i, j;
+
+    for (i = 0; i < MAX_DEV; i++) {
+        line = &irq_lines[i];
+
+        for (j = 0; j < line->count; j++)
+            if (line->devs[j] == pmdev)
+                break;
+
+        if (j == line->count)
+            continue;
+
+        if (line->count == 1) {
+            free_irq(line->irq, line);
+            line->count = 0;
+        } else {
+            line->devs[j] = line->devs[line->count - 1];
+            WRITE_ONCE(line->count, line->count - 1);
+
+            // The handler may still be walking the old list
+            synchronize_irq(line->irq);
+        }
+
+        break;
+    }
+
+    pmdev->irq = 0;
+}
+
 /* Device open */
 static int device_open(struct inode *inode, struct file *file)
 {
     struct pcmmio_device *pmdev;
+    struct pcmmio_file *pf;
 
     pmdev = container_of(inode->i_cdev, struct pcmmio_device, cdev);
 
-    file->private_data = pmdev;
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+
+    pf->pmdev = pmdev;
+    pf->priority = MIO_PRIO_NORMAL;
+
+    file->private_data = pf;
 
     pr_devel("[%s] device_open\n", pmdev->name);
 
     return 0;
 }
 
+/* Anything for read(), device events or completions of our commands */
+static inline bool read_ready(struct pcmmio_file *pf)
+{
+    return PCMMIO_INT_DEPTH(pf->pmdev) || PCMMIO_DONE_DEPTH(pf);
+}
+
+// Read events, each record is a struct mio_event. Through read_iter the
+// same code serves read(), readv() and splice(), so a logger can move the
+// stream into a pipe and on to a file or socket without copying it
+// through user space.
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *file = iocb->ki_filp;
+    struct pcmmio_file *pf = file->private_data;
+    struct pcmmio_device *pmdev = pf->pmdev;
+    size_t count = iov_iter_count(to);
+    struct mio_event ev;
+    size_t done = 0;
+
+    if (count < sizeof(ev))
+        return -EINVAL;
+
+    while (!done) {
+        if (!read_ready(pf)) {
+            if (file->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+
+            if (wait_event_interruptible(pmdev->wq, read_ready(pf)))
+                return -ERESTARTSYS;
+        }
+
+        // Another reader may have emptied the queue, go back to waiting then
+        while (done + sizeof(ev) <= count && cmd_dequeue(pf, &ev)) {
+            if (copy_to_iter(&ev, sizeof(ev), to) != sizeof(ev))
+                return done ? done : -EFAULT;
+
+            done += sizeof(ev);
+        }
+    }
+
+    return done;
+}
+
+static unsigned int device_poll(struct file *file, poll_table *wait)
+{
+    struct pcmmio_device *pmdev = file_pmdev(file);
+
+    poll_wait(file, &pmdev->wq, wait);
+
+    return read_ready(file->private_data) ? POLLIN | POLLRDNORM : 0;
+}
+
+// Map the state page read only. The page is inserted rather than remapped
+// so the mapping holds a reference and stays valid after the driver is
+// unloaded.
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct pcmmio_device *pmdev = file_pmdev(file);
+
+    if (!pmdev->state)
+        return -ENODEV;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+        return -EINVAL;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+    return vm_insert_page(vma, vma->vm_start, virt_to_page(pmdev->state));
+}
+
 /* Device close */
 static int device_release(struct inode *inode, struct file *file)
 {
@@ -185,34 +827,193 @@ static int device_release(struct inode *inode, struct file *file)
 
     pr_devel("[%s] device_release\n", pmdev->name);
 
+    eventfd_release(pmdev, file);
+    cmd_release(pmdev, file);
+
+    if (((struct pcmmio_file *) file->private_data)->priority == MIO_PRIO_HIGH)
+        atomic_dec(&pmdev->hp_clients);
+
+    kfree(file->private_data);
+
     return 0;
 }
 
+/* Sources in the mask whose completion counter has moved on */
+static u32 wait_ready(struct pcmmio_device *pmdev, const struct mio_wait *wait)
+{
+    u32 ready = 0;
+    int i;
+
+    for (i = 0; i < MIO_SOURCES; i++)
+        if ((wait->mask & (1 << i)) && READ_ONCE(pmdev->completions[i]) != wait->count[i])
+            ready |= 1 << i;
+
+    return ready;
+}
+
+/* Bind, rebind or (mask 0) unbind an eventfd for this file */
+static int eventfd_bind(struct pcmmio_device *pmdev, struct file *file, int fd, u32 mask)
+{
+    struct pcmmio_eventfd *efd, *slot = NULL, *free = NULL;
+    struct eventfd_ctx *ctx;
+    unsigned long flags;
+    int i, puts = 1, ret = 0;
+
+    ctx = eventfd_ctx_fdget(fd);
+    if (IS_ERR(ctx))
+        return PTR_ERR(ctx);
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (i = 0; i < MAX_EVENTFDS; i++) {
+        efd = &pmdev->eventfds[i];
+
+        if (efd->ctx == ctx && efd->owner == file)
+            slot = efd;
+        else if (!efd->ctx && !free)
+            free = efd;
+    }
+
+    // The slot keeps the reference from the first bind, so a rebind
+    // drops the one we just took and an unbind drops both
+    if (slot && mask) {
+        slot->mask = mask;
+    } else if (slot) {
+        memset(slot, 0, sizeof(*slot));
+        puts = 2;
+    } else if (!mask) {
+        ret = -ENOENT;
+    } else if (!free) {
+        ret = -ENOSPC;
+    } else {
+        free->ctx = ctx;
+        free->owner = file;
+        free->mask = mask;
+        puts = 0;
+    }
+
+    pmdev->eventfd_mask = 0;
+
+    for (i = 0; i < MAX_EVENTFDS; i++)
+        pmdev->eventfd_mask |= pmdev->eventfds[i].mask;
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    while (puts--)
+        eventfd_ctx_put(ctx);
+
+    return ret;
+}
+
 #define PCMMIO_WAIT_READY(__d, __t) do {		\
     __d->ready_##__t = 0;				\
     wait_event(__d->wq, __d->ready_##__t);		\
 } while(0)
 
-/* Device ioctl */
-static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_param)
+// Take the device mutex and report how long we waited for it. A file of
+// normal priority stands aside while a high priority file is waiting, so
+// a control loop is not queued behind a string of maintenance commands.
+static int ioctl_lock(struct file *file, u64 *lock_wait)
+{
+    struct pcmmio_file *pf = file->private_data;
+    struct pcmmio_device *pmdev = pf->pmdev;
+    u64 start = ktime_get_ns();
+    int ret;
+
+    if (pf->priority == MIO_PRIO_HIGH) {
+        atomic_inc(&pmdev->hp_waiting);
+
+        ret = mutex_lock_interruptible(&pmdev->mtx);
+
+        if (atomic_dec_and_test(&pmdev->hp_waiting))
+            wake_up_all(&pmdev->prio_wq);
+    } else {
+        for (;;) {
+            ret = wait_event_interruptible(pmdev->prio_wq, !atomic_read(&pmdev->hp_waiting));
+            if (ret)
+                break;
+
+            ret = mutex_lock_interruptible(&pmdev->mtx);
+            if (ret || !atomic_read(&pmdev->hp_waiting))
+                break;
+
+            mutex_unlock(&pmdev->mtx);
+        }
+    }
+
+    *lock_wait = ktime_get_ns() - start;
+
+    return ret;
+}
+
+/* Hand the mutex to a waiting high priority file at a safe point of a
+ * long operation and take it back afterwards */
+static void ioctl_yield(struct pcmmio_device *pmdev)
+{
+    if (!atomic_read(&pmdev->hp_waiting))
+        return;
+
+    mutex_unlock(&pmdev->mtx);
+
+    wait_event(pmdev->prio_wq, !atomic_read(&pmdev->hp_waiting));
+
+    mutex_lock(&pmdev->mtx);
+
+    pmdev->yields++;
+}
+
+/* Take the device mutex at normal priority for in-kernel work, which has
+ * no signal to give up on */
+static void prio_lock(struct pcmmio_device *pmdev)
+{
+    for (;;) {
+        wait_event(pmdev->prio_wq, !atomic_read(&pmdev->hp_waiting));
+
+        mutex_lock(&pmdev->mtx);
+        if (!atomic_read(&pmdev->hp_waiting))
+            return;
+
+        mutex_unlock(&pmdev->mtx);
+    }
+}
+
+/* Ioctl command processing */
+static long do_ioctl(struct file *file, struct pcmmio_device *pmdev, unsigned int ioctl_num, unsigned long ioctl_param, u64 *lock_wait)
 {
     unsigned short word_val;
     unsigned char byte_val, offset_val;
-    struct pcmmio_device *pmdev = file->private_data;
-    unsigned base_port = pmdev->base_port;
-    int i;
-
-    pr_devel("[%s] IOCTL CODE %04X\n", pmdev->name, ioctl_num);
+    struct mio_adc_scan scan;
+    struct mio_rule rule;
+    struct mio_adc_alarm alarm;
+    struct mio_wait wait;
+    struct mio_eventfd efd;
+    struct mio_quad quad;
+    struct mio_quad_state quad_state;
+    struct mio_pwm pwm;
+    struct mio_config config;
+    struct pcmmio_file *pf = file->private_data;
+    unsigned char channels[16];
+    unsigned long flags;
+    u64 stamp;
+    int i, count, ret;
 
     /* Switch according to the ioctl called */
     switch (ioctl_num) {
         case ADC_WRITE_COMMAND:
-            mutex_lock_interruptible(&pmdev->mtx);
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
 
             /* This is the data value. */
             offset_val = (ioctl_param & 0xff) ? 4 : 0;
             byte_val = ioctl_param >> 8;
-            outb(byte_val, base_port + ADC1_COMMAND + offset_val);
+            mio_outb(pmdev, byte_val, ADC1_COMMAND + offset_val);
+
+            // Remember the mode so in-kernel conversions use it too
+            pmdev->adc_mode[offset_val * 2 + ADC_CHANNEL(byte_val)] = byte_val;
+
+            // The data register trails the commands by one conversion
+            pmdev->adc_prev[offset_val / 4] = pmdev->adc_last[offset_val / 4];
+            pmdev->adc_last[offset_val / 4] = offset_val * 2 + ADC_CHANNEL(byte_val) + 1;
 
             mutex_unlock(&pmdev->mtx);
 
@@ -220,11 +1021,18 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
 
         case ADC_READ_DATA:
             offset_val = (ioctl_param & 0xff) ? 4 : 0;
-            return inw(base_port + offset_val);
+            word_val = mio_inw(pmdev, ADC1_DATA_LO + offset_val);
+
+            if (pmdev->adc_prev[offset_val / 4]) {
+                byte_val = pmdev->adc_prev[offset_val / 4] - 1;
+                state_adc(pmdev, &byte_val, 1, &word_val);
+            }
+
+            return word_val;
 
         case ADC_READ_STATUS:
             offset_val = (ioctl_param & 0xff) ? 4 : 0;
-            return inb(base_port + ADC1_STATUS + offset_val);
+            return mio_inb(pmdev, ADC1_STATUS + offset_val);
 
         case ADC1_WAIT_INT:
             PCMMIO_WAIT_READY(pmdev, adc_1);
@@ -235,12 +1043,18 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
             return 0;
 
         case DAC_WRITE_DATA:
-            mutex_lock_interruptible(&pmdev->mtx);
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
 
             /* This is the data value. */
             offset_val = (ioctl_param & 0xff) ? 4 : 0;
             word_val = (ioctl_param >> 8) & 0xffff;
-            outw(word_val, base_port + DAC1_DATA_LO + offset_val);
+
+            // A rule firing in between must see the value it has to restore
+            spin_lock_irqsave(&pmdev->spnlck, flags);
+            mio_outw(pmdev, word_val, DAC1_DATA_LO + offset_val);
+            pmdev->dac_data[offset_val / 4] = word_val;
+            spin_unlock_irqrestore(&pmdev->spnlck, flags);
 
             mutex_unlock(&pmdev->mtx);
 
@@ -248,15 +1062,20 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
 
         case DAC_READ_STATUS:
             offset_val = (ioctl_param & 0xff) ? 4 : 0;
-            return inb(base_port + DAC1_STATUS + offset_val);
+            return mio_inb(pmdev, DAC1_STATUS + offset_val);
 
         case DAC_WRITE_COMMAND:
-            mutex_lock_interruptible(&pmdev->mtx);
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
 
             /* This is the data value. */
             offset_val = (ioctl_param & 0xff) ? 4 : 0;
             byte_val = ioctl_param >> 8;
-            outb(byte_val, base_port + DAC1_COMMAND + offset_val);
+            mio_outb(pmdev, byte_val, DAC1_COMMAND + offset_val);
+
+            spin_lock_irqsave(&pmdev->spnlck, flags);
+            state_dac(pmdev, offset_val / 4, byte_val, pmdev->dac_data[offset_val / 4]);
+            spin_unlock_irqrestore(&pmdev->spnlck, flags);
 
             mutex_unlock(&pmdev->mtx);
 
@@ -271,11 +1090,17 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
             return 0;
 
         case DIO_WRITE_BYTE:
-            mutex_lock_interruptible(&pmdev->mtx);
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
 
             offset_val = ioctl_param & 0xff;
             byte_val = ioctl_param >> 8;
-            outb(byte_val, base_port + DIO_PORT0 + offset_val);
+
+            // Keep the image current, gpiolib shares it with us
+            if (offset_val < 6)
+                dio_write_port(pmdev, offset_val, byte_val);
+            else
+                mio_outb(pmdev, byte_val, DIO_PORT0 + offset_val);
 
             mutex_unlock(&pmdev->mtx);
 
@@ -283,25 +1108,35 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
 
         case DIO_READ_BYTE:
             offset_val = ioctl_param & 0xff;
-            return inb(base_port + DIO_PORT0 + offset_val);
+            byte_val = mio_inb(pmdev, DIO_PORT0 + offset_val);
+
+            if (offset_val < 6)
+                state_port(pmdev, offset_val, byte_val);
+
+            return byte_val;
 
         case DIO_WAIT_INT:
-            if ((i = get_buffered_int(pmdev)))
+            if ((i = get_buffered_int(pmdev, NULL)))
                 return i;
 
             PCMMIO_WAIT_READY(pmdev, dio);
 
-            return get_buffered_int(pmdev);
+            // Account for the time from the interrupt to this point
+            if ((i = get_buffered_int(pmdev, &stamp)) && stamp)
+                hist_add(&pmdev->wake_latency, ktime_get_ns() - stamp);
+
+            return i;
 
         case DIO_GET_INT:
-            return get_buffered_int(pmdev) & 0xff;
+            return get_buffered_int(pmdev, NULL) & 0xff;
 
         case MIO_WRITE_REG:
-            mutex_lock_interruptible(&pmdev->mtx);
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
 
             offset_val = ioctl_param & 0xff;
             byte_val = ioctl_param >> 8;
-            outb(byte_val, base_port + offset_val);
+            mio_outb(pmdev, byte_val, offset_val);
 
             mutex_unlock(&pmdev->mtx);
 
@@ -309,23 +1144,370 @@ static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
 
         case MIO_READ_REG:
             offset_val = ioctl_param & 0xff;
-            return inb(base_port + offset_val);
+            return mio_inb(pmdev, offset_val);
 
-        default:
-            return -EINVAL;
-    }
-}
+        case ADC_SCAN:
+            if (copy_from_user(&scan, (void __user *) ioctl_param, sizeof(scan)))
+                return -EFAULT;
 
-//***********************************************************************
-//			Module Declarations
-// This structure will hold the functions to be called
-// when a process does something to the our device
-//***********************************************************************
-static struct file_operations pcmmio_ws_fops = {
-    owner:			THIS_MODULE,
-    unlocked_ioctl:		device_ioctl,
-    open:			device_open,
-    release:		device_release,
+            for (i = count = 0; i < 16; i++)
+                if (scan.channels & (1 << i))
+                    channels[count++] = i;
+
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
+
+            ret = adc_scan_sliced(pmdev, channels, count, scan.data,
+                                  scan.flags & MIO_SCAN_PARALLEL,
+                                  pf->priority != MIO_PRIO_HIGH && atomic_read(&pmdev->hp_clients));
+
+            mutex_unlock(&pmdev->mtx);
+
+            if (ret)
+                return ret;
+
+            // Spread the results from list order out to channel order
+            for (i = count - 1; i >= 0; i--)
+                scan.data[channels[i]] = scan.data[i];
+
+            if (copy_to_user((void __user *) ioctl_param, &scan, sizeof(scan)))
+                return -EFAULT;
+
+            return 0;
+
+        case DIO_ADD_RULE:
+            if (copy_from_user(&rule, (void __user *) ioctl_param, sizeof(rule)))
+                return -EFAULT;
+
+            if (rule.bit < 1 || rule.bit > 24 || rule.edge > FALLING)
+                return -EINVAL;
+
+            if ((rule.action == MIO_RULE_DIO && rule.target > 5) ||
+                (rule.action == MIO_RULE_DAC && rule.target > 7) ||
+                rule.action > MIO_RULE_DAC)
+                return -EINVAL;
+
+            // The table is walked by irq_handler, so update it under the spinlock
+            spin_lock_irqsave(&pmdev->spnlck, flags);
+
+            if (pmdev->rule_count == MAX_RULES) {
+                spin_unlock_irqrestore(&pmdev->spnlck, flags);
+                return -ENOSPC;
+            }
+
+            i = pmdev->rule_count++;
+            pmdev->rules[i] = rule;
+            pmdev->rule_bits |= 1 << (rule.bit - 1);
+
+            spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+            return i;
+
+        case DIO_CLEAR_RULES:
+            spin_lock_irqsave(&pmdev->spnlck, flags);
+
+            pmdev->rule_count = 0;
+            pmdev->rule_bits = 0;
+
+            spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+            return 0;
+
+        case ADC_SET_ALARM:
+            if (copy_from_user(&alarm, (void __user *) ioctl_param, sizeof(alarm)))
+                return -EFAULT;
+
+            if (alarm.channel > 15 || (alarm.mode & ~MIO_ALARM_WINDOW))
+                return -EINVAL;
+
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
+
+            pmdev->alarms[alarm.channel] = alarm;
+            pmdev->alarm_state[alarm.channel] = 0;
+
+            if (alarm.mode)
+                pmdev->alarm_mask |= 1 << alarm.channel;
+            else
+                pmdev->alarm_mask &= ~(1 << alarm.channel);
+
+            mutex_unlock(&pmdev->mtx);
+
+            return 0;
+
+        case ADC_MONITOR:
+            // Each pass scans every alarm channel and holds the converters
+            if (ioctl_param && (ioctl_param < MIN_MONITOR_PERIOD || ioctl_param > UINT_MAX))
+                return -EINVAL;
+
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
+
+            // The monitor rearms itself under the mutex while this is non zero
+            pmdev->monitor_ms = ioctl_param;
+
+            mutex_unlock(&pmdev->mtx);
+
+            if (pmdev->monitor_ms)
+                mod_delayed_work(system_wq, &pmdev->monitor, 0);
+            else
+                cancel_delayed_work_sync(&pmdev->monitor);
+
+            return 0;
+
+        case MIO_WAIT:
+            if (copy_from_user(&wait, (void __user *) ioctl_param, sizeof(wait)))
+                return -EFAULT;
+
+            if (!wait.mask || wait.mask >= (1 << MIO_SOURCES))
+                return -EINVAL;
+
+            if (wait.timeout_ms)
+                ret = wait_event_interruptible_timeout(pmdev->wq, wait_ready(pmdev, &wait),
+                                                       msecs_to_jiffies(wait.timeout_ms));
+            else
+                ret = wait_event_interruptible(pmdev->wq, wait_ready(pmdev, &wait));
+
+            if (ret < 0)
+                return -ERESTARTSYS;
+
+            // Take one snapshot so the mask and the counters agree
+            wait.ready = 0;
+
+            for (i = 0; i < MIO_SOURCES; i++) {
+                count = READ_ONCE(pmdev->completions[i]);
+
+                if ((wait.mask & (1 << i)) && count != wait.count[i])
+                    wait.ready |= 1 << i;
+
+                wait.count[i] = count;
+            }
+
+            if (copy_to_user((void __user *) ioctl_param, &wait, sizeof(wait)))
+                return -EFAULT;
+
+            return wait.ready;
+
+        case MIO_SET_EVENTFD:
+            if (copy_from_user(&efd, (void __user *) ioctl_param, sizeof(efd)))
+                return -EFAULT;
+
+            if (efd.mask >= (1 << MIO_SOURCES))
+                return -EINVAL;
+
+            return eventfd_bind(pmdev, file, efd.fd, efd.mask);
+
+        case DIO_SET_QUAD:
+            if (copy_from_user(&quad, (void __user *) ioctl_param, sizeof(quad)))
+                return -EFAULT;
+
+            if (quad.channel >= MAX_QUAD)
+                return -EINVAL;
+
+            if (quad.bit_a && (quad.bit_a > 24 || quad.bit_b < 1 || quad.bit_b > 24 || quad.bit_a == quad.bit_b))
+                return -EINVAL;
+
+            return quad_set(pmdev, &quad);
+
+        case DIO_SET_PWM:
+            if (copy_from_user(&pwm, (void __user *) ioctl_param, sizeof(pwm)))
+                return -EFAULT;
+
+            if (pwm.bit < 1 || pwm.bit > 48 || pwm.duty_us > pwm.period_us)
+                return -EINVAL;
+
+            if (pwm.period_us && pwm.period_us < MIN_PWM_PERIOD)
+                return -EINVAL;
+
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
+
+            ret = pwm_set(pmdev, &pwm);
+
+            mutex_unlock(&pmdev->mtx);
+
+            return ret;
+
+        case DIO_SCAN:
+            // Range check the whole argument, scan_start takes an unsigned
+            if (ioctl_param && (ioctl_param < MIN_SCAN_PERIOD || ioctl_param > UINT_MAX))
+                return -EINVAL;
+
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
+
+            if (ioctl_param)
+                scan_start(pmdev, ioctl_param);
+            else
+                scan_stop(pmdev);
+
+            mutex_unlock(&pmdev->mtx);
+
+            return 0;
+
+        case MIO_GET_CONFIG:
+            if (ioctl_lock(file, lock_wait))
+                return -ERESTARTSYS;
+
+            config_snapshot(pmdev, &config);
+
+            mutex_unlock(&pmdev->mtx);
+
+            if (copy_to_user((void __user *) ioctl_param, &config, sizeof(config)))
+                return -EFAULT;
+
+            return 0;
+
+        case MIO_SET_PRIORITY:
+            if (ioctl_param > MIO_PRIO_HIGH)
+                return -EINVAL;
+
+            // hp_clients counts the files currently set to high
+            if (xchg(&pf->priority, ioctl_param) == MIO_PRIO_HIGH)
+                atomic_dec(&pmdev->hp_clients);
+
+            if (ioctl_param == MIO_PRIO_HIGH)
+                atomic_inc(&pmdev->hp_clients);
+
+            return 0;
+
+        case DIO_BOTH_EDGES:
+            offset_val = ioctl_param & 0xff;
+            byte_val = ioctl_param >> 8;
+
+            if (offset_val < 1 || offset_val > 24)
+                return -EINVAL;
+
+            return dio_both_edges(pmdev, offset_val - 1, byte_val);
+
+        case DIO_GET_QUAD:
+            quad_get(pmdev, &quad_state);
+
+            if (copy_to_user((void __user *) ioctl_param, &quad_state, sizeof(quad_state)))
+                return -EFAULT;
+
+            return 0;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+/* Device ioctl */
+static long device_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_param)
+{
+    struct pcmmio_device *pmdev = file_pmdev(file);
+    struct pcmmio_ioctl_stats *stats;
+    u64 start, elapsed, lock_wait = U64_MAX;
+    long ret;
+
+    pr_devel("[%s] IOCTL CODE %04X\n", pmdev->name, ioctl_num);
+
+    trace_pcmmio_ioctl_enter(pmdev->name, ioctl_num, ioctl_param);
+
+    flight_record(pmdev, FLIGHT_IOCTL, _IOC_NR(ioctl_num), ioctl_param);
+
+    start = ktime_get_ns();
+
+    ret = do_ioctl(file, pmdev, ioctl_num, ioctl_param, &lock_wait);
+
+    elapsed = ktime_get_ns() - start;
+
+    trace_pcmmio_ioctl_exit(pmdev->name, ioctl_num, ret, elapsed);
+
+    // Split the time into mutex contention and the remaining hardware time,
+    // commands that never take the mutex leave lock_wait untouched
+    if (_IOC_NR(ioctl_num) < IOCTL_STATS && ret != -EINVAL) {
+        stats = &pmdev->ioctl_stats[_IOC_NR(ioctl_num)];
+
+        if (lock_wait != U64_MAX) {
+            hist_add(&stats->lock_wait, lock_wait);
+            elapsed -= min(lock_wait, elapsed);
+        }
+
+        hist_add(&stats->service, elapsed);
+    }
+
+    return ret;
+}
+
+/* Submit commands, each record is a struct mio_cmd */
+static ssize_t device_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct pcmmio_device *pmdev = file_pmdev(file);
+    struct mio_event ev = { 0 };
+    struct mio_cmd cmd;
+    size_t done;
+    u64 lock_wait;
+    long ret = 0;
+    int source;
+
+    if (count % sizeof(cmd))
+        return -EINVAL;
+
+    ev.type = MIO_EVENT_COMPLETION;
+
+    for (done = 0; done < count; done += sizeof(cmd)) {
+        if (copy_from_user(&cmd, buf + done, sizeof(cmd))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        source = cmd_wait_source(cmd.command);
+
+        if (source >= 0) {
+            // Accept what fits, the caller resubmits the rest
+            if (!cmd_park(pmdev, file, &cmd, source)) {
+                ret = -EBUSY;
+                break;
+            }
+
+            continue;
+        }
+
+        if (!cmd_immediate(cmd.command)) {
+            ret = -EINVAL;
+            break;
+        }
+
+        // Run nothing whose completion could not be kept
+        if (!cmd_room(pmdev, file)) {
+            ret = -EBUSY;
+            break;
+        }
+
+        ret = do_ioctl(file, pmdev, cmd.command, cmd.arg, &lock_wait);
+        if (ret == -ERESTARTSYS)
+            break;
+
+        ev.timestamp = ktime_get_ns();
+        ev.user_data = cmd.user_data;
+        ev.result = ret;
+        ev.command = cmd.command;
+        cmd_post(pmdev, file, &ev);
+    }
+
+    if (done)
+        wake_up_all(&pmdev->wq);
+
+    return done ? done : ret;
+}
+
+//***********************************************************************
+//			Module Declarations
+// This structure will hold the functions to be called
+// when a process does something to the our device
+//***********************************************************************
+static struct file_operations pcmmio_ws_fops = {
+    owner:			THIS_MODULE,
+    read_iter:		device_read_iter,
+    splice_read:	generic_file_splice_read,
+    write:			device_write,
+    poll:			device_poll,
+    mmap:			device_mmap,
+    unlocked_ioctl:		device_ioctl,
+    open:			device_open,
+    release:		device_release,
 };
 
 /* Module entry point */
@@ -336,6 +1518,9 @@ int init_module()
 
     pr_info(MOD_DESC " loading\n");
 
+    /* Statistics live in debugfs, a failure here is not fatal */
+    pcmmio_debug_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+
     pcmmio_class = class_create(THIS_MODULE, KBUILD_MODNAME);
     if (IS_ERR(pcmmio_class)) {
         pr_err("Could not create module class\n");
@@ -359,16 +1544,32 @@ int init_module()
     for (i = io_num = 0; i < MAX_DEV; i++) {
         struct pcmmio_device *pmdev = &pcmmio_devs[i];
 
-        if (io[i] == 0)
+        if (io[i] == 0 && !sim[i])
             continue;
 
         /* Initialize device context */
         mutex_init(&pmdev->mtx);
         spin_lock_init(&pmdev->spnlck);
+        spin_lock_init(&pmdev->isr_lock);
         init_waitqueue_head(&pmdev->wq);
+        init_waitqueue_head(&pmdev->prio_wq);
+        INIT_DELAYED_WORK(&pmdev->monitor, adc_monitor_work);
+        poll_init(pmdev);
+        pwm_init(pmdev);
+        scan_init(pmdev);
         
         sprintf(pmdev->name, KBUILD_MODNAME "%c", 'a' + i);
 
+        // The recorder is optional, records are dropped without it
+        pmdev->flight = alloc_percpu(struct pcmmio_flight);
+        if (!pmdev->flight)
+            pr_err("[%s] Unable to allocate flight recorder\n", pmdev->name);
+
+        // Without the state page the device works, it just cannot be mapped
+        pmdev->state = (struct mio_state *) get_zeroed_page(GFP_KERNEL);
+        if (!pmdev->state)
+            pr_err("[%s] Unable to allocate state page\n", pmdev->name);
+
         dev = pcmmio_devno + i;
 
         /* Initialize character device */
@@ -380,8 +1581,15 @@ int init_module()
             return ret_val;
         }
 
-        /* Check and map our I/O region requests. */
-        if (request_region(io[i], 0x20, KBUILD_MODNAME) == NULL) {
+        if (sim[i]) {
+            /* The register model stands in for the card, no I/O region needed */
+            if (sim_init(pmdev, sim_rate[i])) {
+                pr_err("Unable to allocate simulated device %d\n", i);
+                cdev_del(&pmdev->cdev);
+                continue;
+            }
+        } else if (request_region(io[i], 0x20, KBUILD_MODNAME) == NULL) {
+            /* Check and map our I/O region requests. */
             pr_err("Unable to use I/O Address %04X\n", io[i]);
             cdev_del(&pmdev->cdev);
             continue;
@@ -390,44 +1598,45 @@ int init_module()
         init_io(pmdev, io[i]);
 
         /* Check and map any interrupts */
-        if (irq[i]) {
-            pmdev->irq = irq[i];
-
-            if (request_irq(irq[i], irq_handler, IRQF_SHARED, KBUILD_MODNAME, pmdev)) {
+        if (pmdev->sim) {
+            /* Interrupts are raised by the model's timers */
+            init_irq(pmdev, 0);
+            sim_start(pmdev);
+        } else if (irq[i]) {
+            if (irq_attach(pmdev, irq[i])) {
                 pr_err("Unable to register IRQ %d\n", irq[i]);
                 release_region(io[i], 0x20);
                 cdev_del(&pmdev->cdev);
                 continue;
             }
 
-            // configure dio/adc1 for selected irq
-            outb(0x08, pmdev->base_port + ADC1_RSRC_ENBL);
-            outb(irq[i], pmdev->base_port + ADC1_RESOURCE);
-            outb(0x10, pmdev->base_port + ADC1_RSRC_ENBL);
-            outb(irq[i], pmdev->base_port + DIO_RESOURCE);
-            outb(0x01, pmdev->base_port + ADC1_RSRC_ENBL);	// Enable the interrupt
-
-            // configure adc2 for selected irq
-            outb(0x08, pmdev->base_port + ADC2_RSRC_ENBL);
-            outb(irq[i], pmdev->base_port + ADC2_RESOURCE);
-            outb(0x01, pmdev->base_port + ADC2_RSRC_ENBL);	// Enable the interrupt
-
-            // configure dac1 for selected irq
-            outb(0x18, pmdev->base_port + DAC1_RSRC_ENBL);
-            outb(irq[i], pmdev->base_port + DAC1_RESOURCE);
-            outb(0x11, pmdev->base_port + DAC1_RSRC_ENBL);	// Enable the interrupt
-
-            // configure dac2 for selected irq
-            outb(0x38, pmdev->base_port + DAC2_RSRC_ENBL);
-            outb(irq[i], pmdev->base_port + DAC2_RESOURCE);
-            outb(0x31, pmdev->base_port + DAC2_RSRC_ENBL);	// Enable the interrupt
+            init_irq(pmdev, irq[i]);
+        } else if (poll_us[i]) {
+            /* Latch interrupts without routing them and poll the ID register */
+            init_irq(pmdev, 0);
+            poll_start(pmdev, max_t(unsigned, poll_us[i], MIN_SCAN_PERIOD));
         }
 
+        if (scan_us[i])
+            scan_start(pmdev, max_t(unsigned, scan_us[i], MIN_SCAN_PERIOD));
+
         io_num++;
 
         pr_info("[%s] Added new device\n", pmdev->name);
 
-        device_create(pcmmio_class, NULL, dev, NULL, "%s", pmdev->name);
+        pmdev->dev = device_create(pcmmio_class, NULL, dev, pmdev, "%s", pmdev->name);
+
+        if (!IS_ERR_OR_NULL(pmdev->dev) && device_create_bin_file(pmdev->dev, &config_attr))
+            pr_warning("[%s] Unable to create config attribute\n", pmdev->name);
+
+        gpio_init(pmdev);
+        iio_init(pmdev);
+
+        pmdev->debug_dir = debugfs_create_dir(pmdev->name, pcmmio_debug_root);
+        debugfs_create_hist("wake_latency", pmdev->debug_dir, &pmdev->wake_latency);
+        debugfs_create_ioctl_stats(pmdev);
+        debugfs_create_counters(pmdev);
+        debugfs_create_flight(pmdev);
     }
 
     if (io_num)
@@ -435,6 +1644,20 @@ int init_module()
 
     pr_warning("No resources available, driver terminating\n");
 
+    // cleanup_module will not run, so give back what the loop allocated
+    for (i = 0; i < MAX_DEV; i++) {
+        struct pcmmio_device *pmdev = &pcmmio_devs[i];
+
+        if (pmdev->state)
+            free_page((unsigned long) pmdev->state);
+
+        free_percpu(pmdev->flight);
+
+        pmdev->state = NULL;
+        pmdev->flight = NULL;
+    }
+
+    debugfs_remove_recursive(pcmmio_debug_root);
     class_destroy(pcmmio_class);
     unregister_chrdev_region(pcmmio_devno, MAX_DEV);
 
@@ -444,27 +1667,96 @@ int init_module()
 /* Module cleanup */
 void cleanup_module()
 {
+    unsigned long flags;
     int i;
 
     for (i = 0; i < MAX_DEV; i++) {
         struct pcmmio_device *pmdev = &pcmmio_devs[i];
 
-        if (pmdev->base_port)
-            release_region(pmdev->base_port, 0x20);
+        iio_exit(pmdev);
+        gpio_exit(pmdev);
+
+        // Silence the edge sources first, an edge storm meanwhile must not
+        // arm poll_timer behind our back
+        if (pmdev->dev) {
+            spin_lock_irqsave(&pmdev->spnlck, flags);
+            pmdev->stopping = true;
+            spin_unlock_irqrestore(&pmdev->spnlck, flags);
+        }
 
         if (pmdev->irq)
-            free_irq(pmdev->irq, pmdev);
+            irq_detach(pmdev);
+
+        if (pmdev->sim)
+            sim_stop(pmdev);
+
+        // Then every timer in one place. The simulated registers stay
+        // until the timers that read them are gone.
+        if (pmdev->dev) {
+            pmdev->monitor_ms = 0;
+            cancel_delayed_work_sync(&pmdev->monitor);
+            poll_stop(pmdev);
+            pwm_stop(pmdev);
+            scan_stop(pmdev);
+        }
+
+        if (pmdev->sim)
+            sim_exit(pmdev);
+        else if (pmdev->base_port)
+            release_region(pmdev->base_port, 0x20);
 
         cdev_del(&pmdev->cdev);
+
+        if (!IS_ERR_OR_NULL(pmdev->dev))
+            device_remove_bin_file(pmdev->dev, &config_attr);
+
         device_destroy(pcmmio_class, pcmmio_devno + i);
+
+        // Mappings that outlive the module hold their own page reference
+        if (pmdev->state)
+            free_page((unsigned long) pmdev->state);
+
+        free_percpu(pmdev->flight);
     }
 
+    debugfs_remove_recursive(pcmmio_debug_root);
     class_destroy(pcmmio_class);
     unregister_chrdev_region(pcmmio_devno, MAX_DEV);
 }
 
 // ********************** Device Subroutines **********************
 
+// The channel selects on the ADC are non contiguous, same table as the library
+static const unsigned char adc_select[8] = {
+    ADC_CH0_SELECT, ADC_CH1_SELECT, ADC_CH2_SELECT, ADC_CH3_SELECT,
+    ADC_CH4_SELECT, ADC_CH5_SELECT, ADC_CH6_SELECT, ADC_CH7_SELECT };
+
+/* Route the ADC, DAC and DIO interrupts to the selected IRQ and enable them */
+static void init_irq(struct pcmmio_device *pmdev, unsigned char irq_num)
+{
+    // configure dio/adc1 for selected irq
+    mio_outb(pmdev, 0x08, ADC1_RSRC_ENBL);
+    mio_outb(pmdev, irq_num, ADC1_RESOURCE);
+    mio_outb(pmdev, 0x10, ADC1_RSRC_ENBL);
+    mio_outb(pmdev, irq_num, DIO_RESOURCE);
+    mio_outb(pmdev, 0x01, ADC1_RSRC_ENBL);	// Enable the interrupt
+
+    // configure adc2 for selected irq
+    mio_outb(pmdev, 0x08, ADC2_RSRC_ENBL);
+    mio_outb(pmdev, irq_num, ADC2_RESOURCE);
+    mio_outb(pmdev, 0x01, ADC2_RSRC_ENBL);	// Enable the interrupt
+
+    // configure dac1 for selected irq
+    mio_outb(pmdev, 0x18, DAC1_RSRC_ENBL);
+    mio_outb(pmdev, irq_num, DAC1_RESOURCE);
+    mio_outb(pmdev, 0x11, DAC1_RSRC_ENBL);	// Enable the interrupt
+
+    // configure dac2 for selected irq
+    mio_outb(pmdev, 0x38, DAC2_RSRC_ENBL);
+    mio_outb(pmdev, irq_num, DAC2_RESOURCE);
+    mio_outb(pmdev, 0x31, DAC2_RSRC_ENBL);	// Enable the interrupt
+}
+
 static void init_io(struct pcmmio_device *pmdev, unsigned io_address)
 {
     int i;
@@ -477,27 +1769,64 @@ static void init_io(struct pcmmio_device *pmdev, unsigned io_address)
 
     // Clear all of the I/O ports. This also makes them inputs
     for (i = 0; i < 6; i++)
-        outb(0, io_address + DIO_PORT0 + i);
+        mio_outb(pmdev, 0, DIO_PORT0 + i);
 
     // Clear the image values as well
     for (i = 0; i < 6; i++)
         pmdev->port_images[i] = 0;
 
+    // Every ADC channel starts out in the default mode
+    for (i = 0; i < 16; i++)
+        pmdev->adc_mode[i] = adc_select[i % 8] | ADC_DEFAULT_MODE;
+
     // Set page 2 access, for interrupt enables
-    outb(PAGE2, io_address + DIO_PAGE_LOCK);
+    mio_outb(pmdev, PAGE2, DIO_PAGE_LOCK);
 
     // Clear all interrupt enables
-    outb(0, io_address + DIO_ENABLE0);
-    outb(0, io_address + DIO_ENABLE1);
-    outb(0, io_address + DIO_ENABLE2);
+    mio_outb(pmdev, 0, DIO_ENABLE0);
+    mio_outb(pmdev, 0, DIO_ENABLE1);
+    mio_outb(pmdev, 0, DIO_ENABLE2);
 
     // Restore page 3 register access
-    outb(PAGE3, io_address + DIO_PAGE_LOCK);
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+
+    // DAC spans are unknown until somebody sets them
+    for (i = 0; i < 8; i++)
+        pmdev->dac_span[i] = 0xff;
+
+    // A saved configuration replaces the defaults
+    config_load(pmdev);
 
     //release lock
     mutex_unlock(&pmdev->mtx);
 }
 
+/* Write a DIO port and its image together, PWM lines keep their level.
+   spnlck held, the caller publishes the outputs */
+static void __dio_write_port(struct pcmmio_device *pmdev, int port, unsigned char val)
+{
+    unsigned char pwm_mask;
+
+    pwm_mask = pmdev->pwm_bits >> (port * 8);
+    val = (val & ~pwm_mask) | (pmdev->port_images[port] & pwm_mask);
+
+    pmdev->port_images[port] = val;
+    mio_outb(pmdev, val, DIO_PORT0 + port);
+}
+
+static void dio_write_port(struct pcmmio_device *pmdev, int port, unsigned char val)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    __dio_write_port(pmdev, port, val);
+
+    state_outputs(pmdev);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
 static void clr_int(struct pcmmio_device *pmdev, int bit_number)
 {
     unsigned short port;
@@ -511,30 +1840,30 @@ static void clr_int(struct pcmmio_device *pmdev, int bit_number)
     spin_lock(&pmdev->spnlck);
 
     // Calculate the I/O address based upon bit number
-    port = pmdev->base_port + DIO_ENABLE0 + (bit_number / 8);
+    port = DIO_ENABLE0 + (bit_number / 8);
 
     // Calculate a bit mask based upon the specified bit number
     mask = (1 << (bit_number % 8));
 
     // Set page 2 access, for interrupt enables
-    outb(PAGE2, pmdev->base_port + DIO_PAGE_LOCK);
+    mio_outb(pmdev, PAGE2, DIO_PAGE_LOCK);
 
     // Get the current state of the interrupt enable register
-    temp = inb(port);
+    temp = mio_inb(pmdev, port);
 
     // Temporarily clear only our enable. This clears the interrupt
     temp= temp & ~mask; // Clear the enable for this bit
 
     // Now update the interrupt enable register
-    outb(temp, port);
+    mio_outb(pmdev, temp, port);
 
     // Re-enable our interrupt bit
     temp = temp | mask;
 
-    outb(temp, port);
+    mio_outb(pmdev, temp, port);
 
     // Restore page 3 register access
-    outb(PAGE3, pmdev->base_port + DIO_PAGE_LOCK);
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
 
     //release lock
     spin_unlock(&pmdev->spnlck);
@@ -550,7 +1879,7 @@ static int get_int(struct pcmmio_device *pmdev)
 
     // Read the master interrupt pending register,
     // mask off undefined bits
-    temp = inb(pmdev->base_port + DIO_INT_PENDING) & 0x07;
+    temp = mio_inb(pmdev, DIO_INT_PENDING) & 0x07;
 
     // If there are no pending interrupts, return 0
     if ((temp & 0x07) == 0) {
@@ -562,7 +1891,7 @@ static int get_int(struct pcmmio_device *pmdev)
     /* Check all three ports */
     for (j = 0; j < 3; j++) {
         // Read the interrupt ID register for port
-        temp = inb(pmdev->base_port + DIO_INT_ID0 + j);
+        temp = mio_inb(pmdev, DIO_INT_ID0 + j);
 
         if (temp == 0)
             continue;
@@ -587,23 +1916,3037 @@ isr_out:
     return ret;
 }
 
-static int get_buffered_int(struct pcmmio_device *pmdev)
+/* Arm a DIO bit for the edge away from its current level, spnlck held */
+static int dio_arm_opposite(struct pcmmio_device *pmdev, int bit)
 {
-    int temp;
+    unsigned char mask = 1 << (bit % 8);
+    unsigned char val;
+    int level;
 
-    if (pmdev->irq == 0) {
-        temp = get_int(pmdev);
-        if (temp)
-            clr_int(pmdev, temp);
-        return temp;
+    level = !!(mio_inb(pmdev, DIO_PORT0 + bit / 8) & mask);
+
+    mio_outb(pmdev, PAGE1, DIO_PAGE_LOCK);
+
+    val = mio_inb(pmdev, DIO_POLARTIY0 + bit / 8);
+
+    // A set polarity bit selects the falling edge
+    if (level)
+        val |= mask;
+    else
+        val &= ~mask;
+
+    mio_outb(pmdev, val, DIO_POLARTIY0 + bit / 8);
+
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+
+    return level;
+}
+
+/* Current level of a DIO bit (0 based) */
+static int dio_level(struct pcmmio_device *pmdev, int bit)
+{
+    return !!(mio_inb(pmdev, DIO_PORT0 + bit / 8) & (1 << (bit % 8)));
+}
+
+/* Edge a DIO interrupt latched on. A bit in both edge mode is re-armed
+ * for the edge away from its new level while page 1 is open. */
+static int dio_take_edge(struct pcmmio_device *pmdev, int bit_number)
+{
+    int bit = bit_number - 1;
+    unsigned char mask = 1 << (bit % 8);
+    unsigned char val;
+    int edge, level;
+
+    spin_lock(&pmdev->spnlck);
+
+    level = dio_level(pmdev, bit);
+
+    mio_outb(pmdev, PAGE1, DIO_PAGE_LOCK);
+
+    val = mio_inb(pmdev, DIO_POLARTIY0 + bit / 8);
+
+    // The card only latches the edge selected by the polarity register
+    edge = (val & mask) ? FALLING : RISING;
+
+    if (pmdev->both_edges & (1 << bit)) {
+        val = level ? val | mask : val & ~mask;
+        mio_outb(pmdev, val, DIO_POLARTIY0 + bit / 8);
     }
 
-    if (pmdev->outptr != pmdev->inptr) {
-        temp = pmdev->int_buffer[pmdev->outptr++];
-        if (pmdev->outptr == MAX_INTS)
-            pmdev->outptr = 0;
-        return temp;
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+
+    spin_unlock(&pmdev->spnlck);
+
+    return edge;
+}
+
+/* Turn both edge mode on or off for a DIO bit (0 based) */
+static int dio_both_edges(struct pcmmio_device *pmdev, int bit, bool enable)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    // A quadrature channel flips the polarity of its own bits
+    if (pmdev->quad_bits & (1 << bit)) {
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+        return -EBUSY;
+    }
+
+    if (enable) {
+        pmdev->both_edges |= 1 << bit;
+        dio_arm_opposite(pmdev, bit);
+    } else {
+        pmdev->both_edges &= ~(1 << bit);
     }
 
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
     return 0;
 }
+
+/* Wait for a DAC to accept the next command, spnlck held */
+static void dac_wait(struct pcmmio_device *pmdev, int dac)
+{
+    int retry;
+
+    for (retry = 0; retry < RULE_DAC_RETRY; retry++)
+        if (mio_inb(pmdev, DAC1_STATUS + dac * 4) & DAC_BUSY)
+            break;
+}
+
+// Run the output rules for a DIO interrupt. Called from irq_handler with
+// the bit just decoded by get_int and the edge it latched on, so the
+// outputs change within a few bus cycles of the edge instead of after a
+// round trip through user space.
+// The port image is updated along with the port so gpiolib and
+// DIO_WRITE_BYTE do not undo the change. A DAC shares its data register
+// between its four channels. A rule borrows it and writes back the last
+// DAC_WRITE_DATA, so a user command that follows its data write in a
+// separate ioctl still latches the user's value.
+static void run_rules(struct pcmmio_device *pmdev, int bit_number, int edge)
+{
+    struct mio_rule *rule;
+    unsigned char val, command;
+    int i, dac;
+
+    spin_lock(&pmdev->spnlck);
+
+    for (i = 0; i < pmdev->rule_count; i++) {
+        rule = &pmdev->rules[i];
+
+        if (rule->bit != bit_number || rule->edge != edge)
+            continue;
+
+        switch (rule->action) {
+            case MIO_RULE_DIO:
+                val = pmdev->port_images[rule->target];
+                val = (val & ~rule->mask) | (rule->value & rule->mask);
+                __dio_write_port(pmdev, rule->target, val);
+                state_outputs(pmdev);
+                break;
+
+            case MIO_RULE_DAC:
+                dac = rule->target / 4;
+                command = (DAC_CMD_WR_UPDATE_CODE << 4) | ((rule->target % 4) << 1);
+
+                dac_wait(pmdev, dac);
+
+                mio_outw(pmdev, rule->code, DAC1_DATA_LO + dac * 4);
+                mio_outb(pmdev, command, DAC1_COMMAND + dac * 4);
+
+                state_dac(pmdev, dac, command, rule->code);
+
+                dac_wait(pmdev, dac);
+
+                mio_outw(pmdev, pmdev->dac_data[dac], DAC1_DATA_LO + dac * 4);
+                break;
+        }
+
+        pmdev->rules_fired++;
+
+        trace_pcmmio_rule(pmdev->name, bit_number, i);
+    }
+
+    spin_unlock(&pmdev->spnlck);
+}
+
+/* Add an event to the ring, the newest event is dropped if it is full.
+ * The caller holds spnlck. */
+static bool __queue_event(struct pcmmio_device *pmdev, const struct mio_event *ev)
+{
+    if ((pmdev->inptr + 1) % MAX_INTS == pmdev->outptr) {
+        pmdev->events_dropped++;
+        return false;
+    }
+
+    pmdev->int_buffer[pmdev->inptr++] = *ev;
+
+    if (pmdev->inptr == MAX_INTS)
+        pmdev->inptr = 0;
+
+    return true;
+}
+
+static bool queue_event(struct pcmmio_device *pmdev, const struct mio_event *ev)
+{
+    unsigned long flags;
+    bool queued;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+    queued = __queue_event(pmdev, ev);
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    return queued;
+}
+
+static bool dequeue_event(struct pcmmio_device *pmdev, struct mio_event *ev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    if (pmdev->outptr == pmdev->inptr) {
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+        return false;
+    }
+
+    *ev = pmdev->int_buffer[pmdev->outptr++];
+
+    if (pmdev->outptr == MAX_INTS)
+        pmdev->outptr = 0;
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    if (ev->type == MIO_EVENT_DIO)
+        trace_pcmmio_dio_dequeue(pmdev->name, ev->source, PCMMIO_INT_DEPTH(pmdev));
+
+    return true;
+}
+
+// Take the oldest DIO event out of the ring for the DIO ioctls. Records
+// of other types queued ahead of it are for read() users, they move up
+// one slot and stay queued in order.
+static bool dequeue_dio(struct pcmmio_device *pmdev, struct mio_event *ev)
+{
+    unsigned long flags;
+    int i, prev;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (i = pmdev->outptr; i != pmdev->inptr; i = (i + 1) % MAX_INTS)
+        if (pmdev->int_buffer[i].type == MIO_EVENT_DIO)
+            break;
+
+    if (i == pmdev->inptr) {
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+        return false;
+    }
+
+    *ev = pmdev->int_buffer[i];
+
+    for (; i != pmdev->outptr; i = prev) {
+        prev = (i + MAX_INTS - 1) % MAX_INTS;
+        pmdev->int_buffer[i] = pmdev->int_buffer[prev];
+    }
+
+    if (++pmdev->outptr == MAX_INTS)
+        pmdev->outptr = 0;
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    trace_pcmmio_dio_dequeue(pmdev->name, ev->source, PCMMIO_INT_DEPTH(pmdev));
+
+    return true;
+}
+
+static int get_buffered_int(struct pcmmio_device *pmdev, u64 *stamp)
+{
+    struct mio_event ev;
+    int temp;
+
+    if (stamp)
+        *stamp = 0;
+
+    if (pmdev->irq == 0 && !pmdev->sim && !ktime_to_ns(pmdev->poll_period)) {
+        temp = get_int(pmdev);
+        if (temp)
+            clr_int(pmdev, temp);
+        return temp;
+    }
+
+    // The DIO calls only know about bits, alarms are left for read() users
+    if (!dequeue_dio(pmdev, &ev))
+        return 0;
+
+    if (stamp)
+        *stamp = ev.timestamp;
+
+    return ev.source;
+}
+
+/* Signal every eventfd bound to one of the completed sources */
+static void eventfd_notify(struct pcmmio_device *pmdev, u32 sources)
+{
+    struct pcmmio_eventfd *efd;
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (i = 0; i < MAX_EVENTFDS; i++) {
+        efd = &pmdev->eventfds[i];
+
+        if (efd->ctx && (efd->mask & sources))
+            eventfd_signal(efd->ctx, hweight32(efd->mask & sources));
+    }
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+/* Drop the eventfds bound through a file that is being closed */
+static void eventfd_release(struct pcmmio_device *pmdev, struct file *file)
+{
+    struct eventfd_ctx *ctx[MAX_EVENTFDS];
+    unsigned long flags;
+    int i, count = 0;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (i = 0; i < MAX_EVENTFDS; i++) {
+        if (pmdev->eventfds[i].owner != file)
+            continue;
+
+        ctx[count++] = pmdev->eventfds[i].ctx;
+        memset(&pmdev->eventfds[i], 0, sizeof(pmdev->eventfds[i]));
+    }
+
+    pmdev->eventfd_mask = 0;
+
+    for (i = 0; i < MAX_EVENTFDS; i++)
+        pmdev->eventfd_mask |= pmdev->eventfds[i].mask;
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    while (count--)
+        eventfd_ctx_put(ctx[count]);
+}
+
+// ********************** State Page **********************
+//
+// Every device has one page holding the latest DIO levels and outputs,
+// ADC results and DAC codes, which any process can map with mmap() and
+// read without a system call. Writers hold spnlck and make seq odd for
+// the length of an update, readers retry until they see the same even
+// seq before and after copying. The page is only ever written here.
+
+static inline void state_begin(struct mio_state *state)
+{
+    WRITE_ONCE(state->seq, state->seq + 1);
+    smp_wmb();
+}
+
+static inline void state_end(struct mio_state *state)
+{
+    state->timestamp = ktime_get_ns();
+    smp_wmb();
+    WRITE_ONCE(state->seq, state->seq + 1);
+}
+
+/* Publish port_images after a DIO write, spnlck held */
+static void state_outputs(struct pcmmio_device *pmdev)
+{
+    if (!pmdev->state)
+        return;
+
+    state_begin(pmdev->state);
+    memcpy(pmdev->state->outputs, pmdev->port_images, 6);
+    state_end(pmdev->state);
+}
+
+/* Publish the six ports as read with a DIO event */
+static void state_inputs(struct pcmmio_device *pmdev, const unsigned char *ports)
+{
+    unsigned long flags;
+
+    if (!pmdev->state)
+        return;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    state_begin(pmdev->state);
+    memcpy(pmdev->state->ports, ports, 6);
+    state_end(pmdev->state);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+/* Publish one port as read with DIO_READ_BYTE */
+static void state_port(struct pcmmio_device *pmdev, int port, unsigned char val)
+{
+    unsigned long flags;
+
+    if (!pmdev->state)
+        return;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    state_begin(pmdev->state);
+    pmdev->state->ports[port] = val;
+    state_end(pmdev->state);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+/* Publish ADC results, channels and data are in the same order */
+static void state_adc(struct pcmmio_device *pmdev, const unsigned char *channels, int count, const unsigned short *data)
+{
+    unsigned long flags;
+    int i;
+
+    if (!pmdev->state)
+        return;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    state_begin(pmdev->state);
+
+    for (i = 0; i < count; i++)
+        pmdev->state->adc[channels[i]] = data[i];
+
+    state_end(pmdev->state);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+// Follow a DAC command through the input buffers to the outputs. A code
+// written to buffer 1 only reaches the output with an update command.
+// Spans are remembered for the device configuration. Called with spnlck
+// held.
+static void state_dac(struct pcmmio_device *pmdev, int dac, unsigned char command, unsigned short data)
+{
+    int channel = dac * 4 + ((command >> 1) & 0x3);
+    int i;
+
+    switch (command >> 4) {
+        case DAC_CMD_WR_UPDATE_SPAN:
+            pmdev->dac_span[channel] = data;
+            return;
+
+        case DAC_CMD_WR_SPAN_UPDATE_ALL:
+            for (i = 0; i < 4; i++)
+                pmdev->dac_span[dac * 4 + i] = data;
+            return;
+
+        case DAC_CMD_WR_B1_CODE:
+            pmdev->dac_b1[channel] = data;
+            return;
+
+        case DAC_CMD_WR_UPDATE_CODE:
+            pmdev->dac_b1[channel] = data;
+            break;
+
+        case DAC_CMD_UPDATE:
+            break;
+
+        case DAC_CMD_WR_CODE_UPDATE_ALL:
+            for (i = 0; i < 4; i++)
+                pmdev->dac_b1[dac * 4 + i] = data;
+            // fall through
+
+        case DAC_CMD_UPDATE_ALL:
+            channel = -1;
+            break;
+
+        default:
+            return;
+    }
+
+    if (!pmdev->state)
+        return;
+
+    state_begin(pmdev->state);
+
+    for (i = dac * 4; i < dac * 4 + 4; i++)
+        if (channel < 0 || i == channel)
+            pmdev->state->dac[i] = pmdev->dac_b1[i];
+
+    state_end(pmdev->state);
+}
+
+// ********************** Device Configuration **********************
+//
+// The driver holds the card setup so every process does not have to send
+// it again. The sysfs binary attribute "config" reads back the live setup
+// as a struct mio_config: ADC channel modes, DAC spans, DIO outputs,
+// polarities and interrupt enables. Writing a struct back applies it at
+// once. Saved as firmware file pcmmio_ws<x>.cfg, for example with
+//
+//     cat /sys/class/pcmmio_ws/pcmmio_wsa/config > /lib/firmware/pcmmio_wsa.cfg
+//
+// it is applied by init_io whenever the module loads. MIO_GET_CONFIG
+// returns the same struct so the library can seed its images from it.
+
+/* Read back the setup the card has now, device mutex held */
+static void config_snapshot(struct pcmmio_device *pmdev, struct mio_config *cfg)
+{
+    unsigned long flags;
+    int i;
+
+    memset(cfg, 0, sizeof(*cfg));
+
+    cfg->magic = MIO_CONFIG_MAGIC;
+    cfg->flags = pmdev->config_applied ? MIO_CONFIG_APPLIED : 0;
+
+    memcpy(cfg->adc_mode, pmdev->adc_mode, sizeof(cfg->adc_mode));
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    memcpy(cfg->dac_span, pmdev->dac_span, sizeof(cfg->dac_span));
+    memcpy(cfg->dio_ports, pmdev->port_images, sizeof(cfg->dio_ports));
+
+    mio_outb(pmdev, PAGE1, DIO_PAGE_LOCK);
+
+    for (i = 0; i < 3; i++)
+        cfg->dio_polarity[i] = mio_inb(pmdev, DIO_POLARTIY0 + i);
+
+    mio_outb(pmdev, PAGE2, DIO_PAGE_LOCK);
+
+    for (i = 0; i < 3; i++)
+        cfg->dio_enable[i] = mio_inb(pmdev, DIO_ENABLE0 + i);
+
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+/* Program the card from a saved setup, device mutex held. PWM, quadrature,
+   both edge, storm and gpiolib interrupt bits keep their current setup */
+static int config_apply(struct pcmmio_device *pmdev, const struct mio_config *cfg)
+{
+    unsigned long flags;
+    unsigned char own;
+    u32 owned;
+    int i, dac;
+
+    if (cfg->magic != MIO_CONFIG_MAGIC)
+        return -EINVAL;
+
+    memcpy(pmdev->adc_mode, cfg->adc_mode, sizeof(pmdev->adc_mode));
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (i = 0; i < 8; i++) {
+        if (cfg->dac_span[i] > DAC_SPAN_BI7)
+            continue;
+
+        dac = i / 4;
+
+        dac_wait(pmdev, dac);
+
+        mio_outw(pmdev, cfg->dac_span[i], DAC1_DATA_LO + dac * 4);
+        mio_outb(pmdev, (DAC_CMD_WR_UPDATE_SPAN << 4) | ((i % 4) << 1), DAC1_COMMAND + dac * 4);
+
+        pmdev->dac_span[i] = cfg->dac_span[i];
+    }
+
+    // Hand the data registers back as the user left them
+    for (dac = 0; dac < 2; dac++) {
+        dac_wait(pmdev, dac);
+        mio_outw(pmdev, pmdev->dac_data[dac], DAC1_DATA_LO + dac * 4);
+    }
+
+    for (i = 0; i < 6; i++)
+        __dio_write_port(pmdev, i, cfg->dio_ports[i]);
+
+    state_outputs(pmdev);
+
+    // Quadrature, both edge, storm and gpiolib interrupt bits are run by
+    // the driver, they keep the polarity and enable their owner set
+    owned = pmdev->quad_bits | pmdev->both_edges | pmdev->storm_mask;
+#ifdef CONFIG_GPIOLIB
+    owned |= pmdev->gpio_irq_enabled;
+#endif
+
+    mio_outb(pmdev, PAGE1, DIO_PAGE_LOCK);
+
+    for (i = 0; i < 3; i++) {
+        own = owned >> (i * 8);
+        mio_outb(pmdev, (cfg->dio_polarity[i] & ~own) | (mio_inb(pmdev, DIO_POLARTIY0 + i) & own),
+                 DIO_POLARTIY0 + i);
+    }
+
+    mio_outb(pmdev, PAGE2, DIO_PAGE_LOCK);
+
+    for (i = 0; i < 3; i++) {
+        own = owned >> (i * 8);
+        mio_outb(pmdev, (cfg->dio_enable[i] & ~own) | (mio_inb(pmdev, DIO_ENABLE0 + i) & own),
+                 DIO_ENABLE0 + i);
+    }
+
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+
+    pmdev->config_applied = true;
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    return 0;
+}
+
+/* Apply pcmmio_ws<x>.cfg if one is installed, called from init_io */
+static void config_load(struct pcmmio_device *pmdev)
+{
+    const struct firmware *fw;
+    char name[48];
+
+    snprintf(name, sizeof(name), "%s.cfg", pmdev->name);
+
+    // A missing file is the normal case, so no fallback and no warning
+    if (request_firmware_direct(&fw, name, NULL))
+        return;
+
+    if (fw->size != sizeof(struct mio_config) ||
+        config_apply(pmdev, (const struct mio_config *) fw->data))
+        pr_warning("[%s] Ignoring invalid configuration %s\n", pmdev->name, name);
+    else
+        pr_info("[%s] Applied configuration %s\n", pmdev->name, name);
+
+    release_firmware(fw);
+}
+
+static ssize_t config_read(struct file *file, struct kobject *kobj,
+                           struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+    struct pcmmio_device *pmdev = dev_get_drvdata(kobj_to_dev(kobj));
+    struct mio_config cfg;
+
+    if (off >= sizeof(cfg))
+        return 0;
+
+    count = min_t(size_t, count, sizeof(cfg) - off);
+
+    mutex_lock(&pmdev->mtx);
+    config_snapshot(pmdev, &cfg);
+    mutex_unlock(&pmdev->mtx);
+
+    memcpy(buf, (char *) &cfg + off, count);
+
+    return count;
+}
+
+static ssize_t config_write(struct file *file, struct kobject *kobj,
+                            struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+    struct pcmmio_device *pmdev = dev_get_drvdata(kobj_to_dev(kobj));
+    int ret;
+
+    // Only a whole configuration is accepted
+    if (off || count != sizeof(struct mio_config))
+        return -EINVAL;
+
+    mutex_lock(&pmdev->mtx);
+    ret = config_apply(pmdev, (const struct mio_config *) buf);
+    mutex_unlock(&pmdev->mtx);
+
+    return ret ? ret : count;
+}
+
+static struct bin_attribute config_attr = {
+    attr: {
+        name: "config",
+        mode: 0644,
+    },
+    size: sizeof(struct mio_config),
+    read: config_read,
+    write: config_write,
+};
+
+// ********************** Command Submission **********************
+//
+// Commands written to the device file are the int argument ioctls with a
+// user_data tag. Register commands run during the write. The *_WAIT_INT
+// commands are parked here and completed by irq_handler when their
+// source next interrupts, so nothing blocks in the kernel on their
+// behalf. Completions go to a ring in the submitting file, so two
+// submitters, or a submitter and a plain reader of the device, never take
+// each other's. read() on that file merges them with the device events in
+// timestamp order. A file's ring always has a slot reserved for each of
+// its parked commands, a command that would overflow it is refused.
+
+/* Interrupt source (status register bit) a wait command completes on */
+static int cmd_wait_source(unsigned int command)
+{
+    switch (command) {
+        case ADC1_WAIT_INT:
+            return ilog2(MIO_SRC_ADC1);
+
+        case ADC2_WAIT_INT:
+            return ilog2(MIO_SRC_ADC2);
+
+        case DAC1_WAIT_INT:
+            return ilog2(MIO_SRC_DAC1);
+
+        case DIO_WAIT_INT:
+            return ilog2(MIO_SRC_DIO);
+
+        case DAC2_WAIT_INT:
+            return ilog2(MIO_SRC_DAC2);
+
+        default:
+            return -1;
+    }
+}
+
+/* Commands that run to completion without waiting on the card */
+static bool cmd_immediate(unsigned int command)
+{
+    switch (command) {
+        case ADC_WRITE_COMMAND:
+        case ADC_READ_DATA:
+        case ADC_READ_STATUS:
+        case DAC_WRITE_DATA:
+        case DAC_READ_STATUS:
+        case DAC_WRITE_COMMAND:
+        case DIO_WRITE_BYTE:
+        case DIO_READ_BYTE:
+        case MIO_WRITE_REG:
+        case MIO_READ_REG:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* Room for one more completion besides those reserved for parked
+ * commands, spnlck held */
+static bool __cmd_room(struct pcmmio_device *pmdev, struct file *file)
+{
+    struct pcmmio_file *pf = file->private_data;
+    int i, parked = 0;
+
+    for (i = 0; i < MAX_PENDING; i++)
+        if (pmdev->pending[i].owner == file)
+            parked++;
+
+    return PCMMIO_DONE_DEPTH(pf) + parked < MAX_COMPLETIONS - 1;
+}
+
+static bool cmd_room(struct pcmmio_device *pmdev, struct file *file)
+{
+    unsigned long flags;
+    bool room;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+    room = __cmd_room(pmdev, file);
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    return room;
+}
+
+/* Queue a completion for the file that submitted the command, spnlck held */
+static void __cmd_post(struct pcmmio_device *pmdev, struct file *file, const struct mio_event *ev)
+{
+    struct pcmmio_file *pf = file->private_data;
+
+    if (PCMMIO_DONE_DEPTH(pf) == MAX_COMPLETIONS - 1) {
+        pmdev->events_dropped++;
+        return;
+    }
+
+    pf->done[pf->done_in] = *ev;
+
+    if (++pf->done_in == MAX_COMPLETIONS)
+        pf->done_in = 0;
+}
+
+static void cmd_post(struct pcmmio_device *pmdev, struct file *file, const struct mio_event *ev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+    __cmd_post(pmdev, file, ev);
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+/* Next record for read(), the older of our next completion and the next
+ * device event */
+static bool cmd_dequeue(struct pcmmio_file *pf, struct mio_event *ev)
+{
+    struct pcmmio_device *pmdev = pf->pmdev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    if (pf->done_out != pf->done_in &&
+        (pmdev->outptr == pmdev->inptr ||
+         pf->done[pf->done_out].timestamp <= pmdev->int_buffer[pmdev->outptr].timestamp)) {
+        *ev = pf->done[pf->done_out];
+
+        if (++pf->done_out == MAX_COMPLETIONS)
+            pf->done_out = 0;
+
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+        return true;
+    }
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    return dequeue_event(pmdev, ev);
+}
+
+/* Park a wait command until its source interrupts, false if none free */
+static bool cmd_park(struct pcmmio_device *pmdev, struct file *file, const struct mio_cmd *cmd, int source)
+{
+    struct pcmmio_pending *pend;
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    // The completion must have a place to go when it comes
+    if (!__cmd_room(pmdev, file)) {
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+        return false;
+    }
+
+    for (i = 0; i < MAX_PENDING; i++) {
+        pend = &pmdev->pending[i];
+
+        if (pend->owner)
+            continue;
+
+        pend->owner = file;
+        pend->user_data = cmd->user_data;
+        pend->command = cmd->command;
+        pend->source = source;
+
+        pmdev->pending_mask |= 1 << source;
+
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+        return true;
+    }
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    return false;
+}
+
+/* Complete every parked command waiting on source, from irq_handler */
+static void cmd_complete(struct pcmmio_device *pmdev, int source, int result)
+{
+    struct mio_event ev = { 0 };
+    struct pcmmio_pending *pend;
+    int i;
+
+    ev.timestamp = ktime_get_ns();
+    ev.type = MIO_EVENT_COMPLETION;
+    ev.result = result;
+
+    spin_lock(&pmdev->spnlck);
+
+    pmdev->pending_mask = 0;
+
+    for (i = 0; i < MAX_PENDING; i++) {
+        pend = &pmdev->pending[i];
+
+        if (!pend->owner)
+            continue;
+
+        if (pend->source != source) {
+            pmdev->pending_mask |= 1 << pend->source;
+            continue;
+        }
+
+        ev.user_data = pend->user_data;
+        ev.command = pend->command;
+        __cmd_post(pmdev, pend->owner, &ev);
+
+        pend->owner = NULL;
+    }
+
+    spin_unlock(&pmdev->spnlck);
+}
+
+/* Forget the commands still parked for a file that is being closed and
+ * the completions nobody read */
+static void cmd_release(struct pcmmio_device *pmdev, struct file *file)
+{
+    struct pcmmio_file *pf = file->private_data;
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    pf->done_in = pf->done_out = 0;
+
+    pmdev->pending_mask = 0;
+
+    for (i = 0; i < MAX_PENDING; i++) {
+        if (pmdev->pending[i].owner == file)
+            pmdev->pending[i].owner = NULL;
+        else if (pmdev->pending[i].owner)
+            pmdev->pending_mask |= 1 << pmdev->pending[i].source;
+    }
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+// ********************** Polled Operation **********************
+//
+// A card loaded with irq=0 and a poll_us period still has its interrupts
+// latched by init_irq, they are just not routed to the bus. An hrtimer
+// samples the interrupt ID register every period and runs irq_handler
+// when anything is pending, so rules, the event ring, timestamps, waits
+// and completions all behave as they do on an interrupt driven card.
+//
+// The same timer handles DIO interrupt storms. A bit that interrupts
+// more than storm_rate times a second has its enable cleared and is
+// sampled by the timer instead, which bounds the cost of a chattering
+// wire to one register read per period. Edges seen by sampling are
+// delivered like interrupts. Once a bit has been polled for
+// STORM_QUIET_NS at under half the storm rate its interrupt comes back.
+
+// Rate measurement window and polling period for stormy bits
+#define STORM_WINDOW_NS     (10 * NSEC_PER_MSEC)
+#define STORM_POLL_NS       (1 * NSEC_PER_MSEC)
+#define STORM_QUIET_NS      (100 * NSEC_PER_MSEC)
+
+static void storm_poll(struct pcmmio_device *pmdev);
+
+static enum hrtimer_restart poll_timer(struct hrtimer *timer)
+{
+    struct pcmmio_device *pmdev = container_of(timer, struct pcmmio_device, poll_timer);
+    bool polled = ktime_to_ns(pmdev->poll_period);
+
+    pmdev->polls++;
+
+    if (polled && (mio_inb(pmdev, DAC2_IRQ_REG) & 0x1F))
+        irq_handler(0, pmdev);
+
+    if (pmdev->storm_mask)
+        storm_poll(pmdev);
+
+    // An interrupt driven card only polls while a storm lasts
+    if (!polled) {
+        spin_lock(&pmdev->spnlck);
+
+        if (!pmdev->storm_mask) {
+            pmdev->storm_polling = false;
+            spin_unlock(&pmdev->spnlck);
+            return HRTIMER_NORESTART;
+        }
+
+        spin_unlock(&pmdev->spnlck);
+    }
+
+    hrtimer_forward_now(timer, polled ? pmdev->poll_period : ns_to_ktime(STORM_POLL_NS));
+
+    return HRTIMER_RESTART;
+}
+
+static void poll_init(struct pcmmio_device *pmdev)
+{
+    hrtimer_init(&pmdev->poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    pmdev->poll_timer.function = poll_timer;
+}
+
+static void poll_start(struct pcmmio_device *pmdev, unsigned period_us)
+{
+    pmdev->poll_period = ns_to_ktime((u64) period_us * NSEC_PER_USEC);
+
+    hrtimer_start(&pmdev->poll_timer, pmdev->poll_period, HRTIMER_MODE_REL);
+
+    pr_info("[%s] Polling interrupts every %u us\n", pmdev->name, period_us);
+}
+
+static void poll_stop(struct pcmmio_device *pmdev)
+{
+    hrtimer_cancel(&pmdev->poll_timer);
+}
+
+/* Set or clear the interrupt enable of a DIO bit (0 based), spnlck held */
+static void dio_set_enable(struct pcmmio_device *pmdev, int bit, bool enable)
+{
+    unsigned port = DIO_ENABLE0 + bit / 8;
+    unsigned char val;
+
+    mio_outb(pmdev, PAGE2, DIO_PAGE_LOCK);
+
+    val = mio_inb(pmdev, port);
+
+    if (enable)
+        val |= 1 << (bit % 8);
+    else
+        val &= ~(1 << (bit % 8));
+
+    mio_outb(pmdev, val, port);
+
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+}
+
+/* Deliver a DIO edge found by sampling rather than by an interrupt,
+ * isr_lock held */
+static void dio_sampled_edge(struct pcmmio_device *pmdev, int bit_number, int edge)
+{
+    dio_dispatch(pmdev, bit_number, edge);
+
+    pmdev->completions[ilog2(MIO_SRC_DIO)]++;
+
+    if (pmdev->pending_mask & MIO_SRC_DIO)
+        cmd_complete(pmdev, ilog2(MIO_SRC_DIO), bit_number);
+}
+
+/* Wake DIO waiters once a batch of sampled edges is queued */
+static void dio_sampled_wake(struct pcmmio_device *pmdev)
+{
+    if (pmdev->eventfd_mask & MIO_SRC_DIO)
+        eventfd_notify(pmdev, MIO_SRC_DIO);
+
+    pmdev->ready_dio = 1;
+    wake_up_all(&pmdev->wq);
+}
+
+/* Count an interrupt on a DIO bit and mask the bit if it is storming */
+static void storm_account(struct pcmmio_device *pmdev, int bit_number)
+{
+    int bit = bit_number - 1;
+    u64 now = ktime_get_ns();
+    unsigned limit;
+    bool start = false;
+
+    if (now - pmdev->storm_window > STORM_WINDOW_NS) {
+        memset(pmdev->storm_hits, 0, sizeof(pmdev->storm_hits));
+        pmdev->storm_window = now;
+    }
+
+    limit = max_t(unsigned, storm_rate / (NSEC_PER_SEC / STORM_WINDOW_NS), 1);
+
+    if (++pmdev->storm_hits[bit] <= limit)
+        return;
+
+    spin_lock(&pmdev->spnlck);
+
+    dio_set_enable(pmdev, bit, false);
+
+    // Sampling needs the level it starts from and the edge to look for
+    mio_outb(pmdev, PAGE1, DIO_PAGE_LOCK);
+    if (mio_inb(pmdev, DIO_POLARTIY0 + bit / 8) & (1 << (bit % 8)))
+        pmdev->storm_polarity |= 1 << bit;
+    else
+        pmdev->storm_polarity &= ~(1 << bit);
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+
+    if (mio_inb(pmdev, DIO_PORT0 + bit / 8) & (1 << (bit % 8)))
+        pmdev->storm_level |= 1 << bit;
+    else
+        pmdev->storm_level &= ~(1 << bit);
+
+    pmdev->storm_mask |= 1 << bit;
+    pmdev->storm_start[bit] = now;
+    pmdev->storm_edges[bit] = 0;
+    pmdev->storm_hits[bit] = 0;
+    pmdev->storms++;
+
+    if (!pmdev->storm_polling && !ktime_to_ns(pmdev->poll_period) && !pmdev->stopping) {
+        pmdev->storm_polling = true;
+        start = true;
+    }
+
+    spin_unlock(&pmdev->spnlck);
+
+    trace_pcmmio_storm(pmdev->name, bit_number, 1);
+
+    if (start)
+        hrtimer_start(&pmdev->poll_timer, ns_to_ktime(STORM_POLL_NS), HRTIMER_MODE_REL);
+}
+
+/* Give a storm masked bit its interrupt back, spnlck held */
+static void storm_release(struct pcmmio_device *pmdev, int bit)
+{
+    // The level may have moved on while the bit was polled
+    if (pmdev->both_edges & (1 << bit))
+        dio_arm_opposite(pmdev, bit);
+
+    dio_set_enable(pmdev, bit, true);
+    pmdev->storm_mask &= ~(1 << bit);
+    pmdev->storm_recoveries++;
+    trace_pcmmio_storm(pmdev->name, bit + 1, 0);
+}
+
+// Sample the masked DIO bits, deliver their edges and unmask quiet ones.
+// Setting storm_rate to 0 at run time unmasks them all on the next pass.
+static void storm_poll(struct pcmmio_device *pmdev)
+{
+    u32 level = 0, edges = 0, rising, falling;
+    u64 now = ktime_get_ns();
+    unsigned long flags;
+    unsigned quiet;
+    int bit, port;
+
+    spin_lock(&pmdev->spnlck);
+
+    for (port = 0; port < 3; port++)
+        if ((pmdev->storm_mask >> (port * 8)) & 0xff)
+            level |= mio_inb(pmdev, DIO_PORT0 + port) << (port * 8);
+
+    level &= pmdev->storm_mask;
+
+    // A set polarity bit selects the falling edge, both edge bits take either
+    rising = level & ~pmdev->storm_level &
+             (~pmdev->storm_polarity | pmdev->both_edges);
+    falling = ~level & pmdev->storm_level &
+              (pmdev->storm_polarity | pmdev->both_edges);
+    edges = (rising | falling) & pmdev->storm_mask;
+
+    pmdev->storm_level = (pmdev->storm_level & ~pmdev->storm_mask) | level;
+
+    // Edges allowed in a quiet period at half the storm rate
+    quiet = storm_rate / 2 / (NSEC_PER_SEC / STORM_QUIET_NS);
+
+    for (bit = 0; bit < 24; bit++) {
+        if (!(pmdev->storm_mask & (1 << bit)))
+            continue;
+
+        if (edges & (1 << bit))
+            pmdev->storm_edges[bit]++;
+
+        if (!storm_rate) {
+            storm_release(pmdev, bit);
+            continue;
+        }
+
+        if (now - pmdev->storm_start[bit] < STORM_QUIET_NS)
+            continue;
+
+        if (pmdev->storm_edges[bit] <= quiet) {
+            storm_release(pmdev, bit);
+        } else {
+            pmdev->storm_start[bit] = now;
+            pmdev->storm_edges[bit] = 0;
+        }
+    }
+
+    spin_unlock(&pmdev->spnlck);
+
+    if (!edges)
+        return;
+
+    spin_lock_irqsave(&pmdev->isr_lock, flags);
+
+    for (bit = 0; bit < 24; bit++) {
+        if (!(edges & (1 << bit)))
+            continue;
+
+        dio_sampled_edge(pmdev, bit + 1,
+                         (rising & (1 << bit)) ? RISING : FALLING);
+        gpio_handle_int(pmdev, bit + 1);
+
+        pmdev->storm_polled++;
+    }
+
+    spin_unlock_irqrestore(&pmdev->isr_lock, flags);
+
+    dio_sampled_wake(pmdev);
+}
+
+// ********************** Port Scanning **********************
+//
+// Only DIO bits 1-24 can interrupt. With scan_us set, or after DIO_SCAN,
+// a second hrtimer samples ports 3-5 and compares them with the previous
+// sample. Every bit that changed is delivered as a timestamped DIO event
+// with bit numbers 25-48, so readers, waits and completions treat all 48
+// lines alike. Lines driven by the PWM are left out. An edge shorter
+// than the period can be missed.
+
+static enum hrtimer_restart scan_timer(struct hrtimer *timer)
+{
+    struct pcmmio_device *pmdev = container_of(timer, struct pcmmio_device, scan_timer);
+    u32 level = 0, changed;
+    unsigned long flags;
+    int bit, port;
+
+    spin_lock(&pmdev->spnlck);
+
+    for (port = 3; port < 6; port++)
+        level |= mio_inb(pmdev, DIO_PORT0 + port) << ((port - 3) * 8);
+
+    if (level != pmdev->scan_level && pmdev->state) {
+        state_begin(pmdev->state);
+
+        for (port = 3; port < 6; port++)
+            pmdev->state->ports[port] = level >> ((port - 3) * 8);
+
+        state_end(pmdev->state);
+    }
+
+    changed = (level ^ pmdev->scan_level) & ~(u32) (pmdev->pwm_bits >> 24);
+    pmdev->scan_level = level;
+    pmdev->scans++;
+
+    spin_unlock(&pmdev->spnlck);
+
+    if (changed) {
+        spin_lock_irqsave(&pmdev->isr_lock, flags);
+
+        for (bit = 0; bit < 24; bit++) {
+            if (!(changed & (1 << bit)))
+                continue;
+
+            dio_sampled_edge(pmdev, bit + 25,
+                             (level & (1 << bit)) ? RISING : FALLING);
+
+            pmdev->scan_changes++;
+        }
+
+        spin_unlock_irqrestore(&pmdev->isr_lock, flags);
+
+        dio_sampled_wake(pmdev);
+    }
+
+    hrtimer_forward_now(timer, pmdev->scan_period);
+
+    return HRTIMER_RESTART;
+}
+
+static void scan_init(struct pcmmio_device *pmdev)
+{
+    hrtimer_init(&pmdev->scan_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    pmdev->scan_timer.function = scan_timer;
+}
+
+// (Re)start the scanner. The first sample is taken here so lines that are
+// already high do not show up as changes.
+static void scan_start(struct pcmmio_device *pmdev, unsigned period_us)
+{
+    unsigned long flags;
+    u32 level = 0;
+    int port;
+
+    hrtimer_cancel(&pmdev->scan_timer);
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (port = 3; port < 6; port++)
+        level |= mio_inb(pmdev, DIO_PORT0 + port) << ((port - 3) * 8);
+
+    pmdev->scan_level = level;
+    pmdev->scan_period = ns_to_ktime((u64) period_us * NSEC_PER_USEC);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    hrtimer_start(&pmdev->scan_timer, pmdev->scan_period, HRTIMER_MODE_REL);
+
+    pr_info("[%s] Scanning DIO bits 25-48 every %u us\n", pmdev->name, period_us);
+}
+
+static void scan_stop(struct pcmmio_device *pmdev)
+{
+    hrtimer_cancel(&pmdev->scan_timer);
+
+    pmdev->scan_period = ns_to_ktime(0);
+}
+
+// ********************** Quadrature Decoding **********************
+//
+// A pair of DIO bits can be decoded as an incremental encoder. The card
+// only interrupts on one edge per bit, so after each interrupt the bit is
+// re-armed for the edge away from the level it has now. The ISR samples
+// both lines, steps the position through the transition table and counts
+// a transition that skipped a state, which is what a missed edge looks
+// like, as an error.
+
+// Position change indexed by previous state * 4 + new state, state is A:B
+#define QUAD_ERR 2
+
+static const signed char quad_table[16] = {
+     0,  1, -1, QUAD_ERR,
+    -1,  0, QUAD_ERR,  1,
+     1, QUAD_ERR,  0, -1,
+    QUAD_ERR, -1,  1,  0 };
+
+/* Configure or (bit_a 0) release a quadrature channel */
+static int quad_set(struct pcmmio_device *pmdev, const struct mio_quad *cfg)
+{
+    struct pcmmio_quad *quad = &pmdev->quad[cfg->channel];
+    unsigned long flags;
+    u32 bits = 0, old = 0;
+    int a = cfg->bit_a - 1, b = cfg->bit_b - 1;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    if (quad->bit_a != quad->bit_b)
+        old = (1 << quad->bit_a) | (1 << quad->bit_b);
+
+    if (cfg->bit_a)
+        bits = (1 << a) | (1 << b);
+
+    // Check before tearing down, a refused change leaves the channel running.
+    // The channel's own bits may be reused. Both edge emulation and storm
+    // polling would fight the decoder over the polarity and enable, a PWM
+    // line is an output.
+    if (((pmdev->quad_bits & ~old) | pmdev->both_edges | pmdev->storm_mask |
+         (u32) pmdev->pwm_bits) & bits) {
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+        return -EBUSY;
+    }
+
+    // Give back the bits the channel had
+    if (old) {
+        dio_set_enable(pmdev, quad->bit_a, false);
+        dio_set_enable(pmdev, quad->bit_b, false);
+
+        pmdev->quad_bits &= ~old;
+    }
+
+    memset(quad, 0, sizeof(*quad));
+
+    if (!cfg->bit_a) {
+        spin_unlock_irqrestore(&pmdev->spnlck, flags);
+        return 0;
+    }
+
+    quad->bit_a = a;
+    quad->bit_b = b;
+    quad->state = (dio_arm_opposite(pmdev, a) << 1) | dio_arm_opposite(pmdev, b);
+
+    pmdev->quad_map[a] = pmdev->quad_map[b] = cfg->channel;
+    pmdev->quad_bits |= bits;
+
+    dio_set_enable(pmdev, a, true);
+    dio_set_enable(pmdev, b, true);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    return 0;
+}
+
+/* Count one encoder edge, called from irq_handler */
+static void quad_update(struct pcmmio_device *pmdev, int bit_number)
+{
+    int bit = bit_number - 1;
+    struct pcmmio_quad *quad = &pmdev->quad[pmdev->quad_map[bit]];
+    unsigned char state;
+    int delta;
+
+    spin_lock(&pmdev->spnlck);
+
+    if (bit == quad->bit_a)
+        state = (dio_arm_opposite(pmdev, bit) << 1) | dio_level(pmdev, quad->bit_b);
+    else
+        state = (dio_level(pmdev, quad->bit_a) << 1) | dio_arm_opposite(pmdev, bit);
+
+    delta = quad_table[quad->state * 4 + state];
+
+    if (delta == QUAD_ERR)
+        quad->errors++;
+    else
+        quad->position += delta;
+
+    quad->state = state;
+
+    spin_unlock(&pmdev->spnlck);
+}
+
+static void quad_get(struct pcmmio_device *pmdev, struct mio_quad_state *state)
+{
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (i = 0; i < MAX_QUAD; i++) {
+        state->position[i] = pmdev->quad[i].position;
+        state->errors[i] = pmdev->quad[i].errors;
+    }
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+// ********************** Software PWM **********************
+//
+// Any DIO line can be driven as a PWM output. One hrtimer per device
+// runs at the earliest pending edge. Every channel whose edge falls
+// within PWM_SLACK_NS of it is switched in the same pass and the new
+// levels are merged into port_images, so lines on one port that switch
+// together cost a single port write. The level is worked out from the
+// time since the channel started rather than by toggling, so a late
+// timer never leaves a channel inverted or drifting.
+
+// Edges this close together are treated as simultaneous
+#define PWM_SLACK_NS        2000
+
+static enum hrtimer_restart pwm_timer(struct hrtimer *timer)
+{
+    struct pcmmio_device *pmdev = container_of(timer, struct pcmmio_device, pwm_timer);
+    struct pcmmio_pwm *pwm;
+    unsigned char set[6] = { 0 }, clr[6] = { 0 }, val;
+    u64 now, t, phase, next = U64_MAX;
+    unsigned long writes = pmdev->pwm_writes;
+    int bit, port;
+
+    spin_lock(&pmdev->spnlck);
+
+    now = ktime_get_ns();
+
+    for (bit = 0; bit < 48; bit++) {
+        if (!(pmdev->pwm_bits & (1ULL << bit)))
+            continue;
+
+        pwm = &pmdev->pwm[bit];
+
+        if (pwm->next <= now + PWM_SLACK_NS) {
+            t = max(now, pwm->next);
+            div64_u64_rem(t - pwm->start, pwm->period, &phase);
+
+            if (phase < pwm->high) {
+                set[bit / 8] |= 1 << (bit % 8);
+                pwm->next = t - phase + pwm->high;
+            } else {
+                clr[bit / 8] |= 1 << (bit % 8);
+                pwm->next = t - phase + pwm->period;
+            }
+
+            pmdev->pwm_edges++;
+        }
+
+        next = min(next, pwm->next);
+    }
+
+    for (port = 0; port < 6; port++) {
+        val = (pmdev->port_images[port] & ~clr[port]) | set[port];
+
+        if (val == pmdev->port_images[port])
+            continue;
+
+        // Every edge would be a record and flush the recorder within a
+        // fraction of a second, pwm_writes counts them instead
+        pmdev->port_images[port] = val;
+        __mio_outb(pmdev, val, DIO_PORT0 + port);
+        pmdev->pwm_writes++;
+    }
+
+    if (pmdev->pwm_writes != writes)
+        state_outputs(pmdev);
+
+    spin_unlock(&pmdev->spnlck);
+
+    if (next == U64_MAX)
+        return HRTIMER_NORESTART;
+
+    hrtimer_set_expires(timer, ns_to_ktime(next));
+
+    return HRTIMER_RESTART;
+}
+
+static void pwm_init(struct pcmmio_device *pmdev)
+{
+    hrtimer_init(&pmdev->pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    pmdev->pwm_timer.function = pwm_timer;
+}
+
+// Start, change or stop the PWM on one line. Called with the device mutex
+// held, the timer is stopped while the channel table changes and started
+// again at once so a new channel does not wait for the next edge of the
+// others.
+static int pwm_set(struct pcmmio_device *pmdev, const struct mio_pwm *cfg)
+{
+    struct pcmmio_pwm *pwm = &pmdev->pwm[cfg->bit - 1];
+    int bit = cfg->bit - 1;
+    unsigned char mask = 1 << (bit % 8);
+    unsigned long flags;
+    u64 now;
+
+    hrtimer_cancel(&pmdev->pwm_timer);
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    now = ktime_get_ns();
+
+    pmdev->pwm_bits &= ~(1ULL << bit);
+
+    // A constant duty needs no timer, the line is just written
+    if (!cfg->period_us || !cfg->duty_us || cfg->duty_us == cfg->period_us) {
+        if (cfg->period_us && cfg->duty_us)
+            pmdev->port_images[bit / 8] |= mask;
+        else
+            pmdev->port_images[bit / 8] &= ~mask;
+
+        mio_outb(pmdev, pmdev->port_images[bit / 8], DIO_PORT0 + bit / 8);
+        state_outputs(pmdev);
+    } else {
+        pwm->start = pwm->next = now;
+        pwm->period = (u64) cfg->period_us * NSEC_PER_USEC;
+        pwm->high = (u64) cfg->duty_us * NSEC_PER_USEC;
+
+        pmdev->pwm_bits |= 1ULL << bit;
+    }
+
+    if (pmdev->pwm_bits)
+        hrtimer_start(&pmdev->pwm_timer, ns_to_ktime(now), HRTIMER_MODE_ABS);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+
+    return 0;
+}
+
+static void pwm_stop(struct pcmmio_device *pmdev)
+{
+    hrtimer_cancel(&pmdev->pwm_timer);
+}
+
+// ********************** ADC Support **********************
+//
+// In-kernel conversions. The ADCs return the result of the previous
+// conversion on each read, so a scan keeps one conversion in flight per
+// converter and finishes with a dummy conversion to flush the last result,
+// exactly as the library's adc_convert_all_channels() does. Conversions
+// complete in a few microseconds, so the status register is polled rather
+// than taking an interrupt per sample. The caller holds pmdev->mtx.
+
+static int adc_wait(struct pcmmio_device *pmdev, int adc)
+{
+    int retry = ADC_RETRY;
+
+    while (retry--)
+        if (mio_inb(pmdev, ADC1_STATUS + adc * 4) & 0x80)
+            return 0;
+
+    return -ETIMEDOUT;
+}
+
+static int adc_convert(struct pcmmio_device *pmdev, int channel)
+{
+    int adc = channel / 8;
+
+    mio_outb(pmdev, pmdev->adc_mode[channel], ADC1_COMMAND + adc * 4);
+
+    return adc_wait(pmdev, adc);
+}
+
+static unsigned short adc_read(struct pcmmio_device *pmdev, int adc)
+{
+    return mio_inw(pmdev, ADC1_DATA_LO + adc * 4);
+}
+
+// Bring the ADC_READ_DATA bookkeeping in line after a scan. A scan ends with
+// a dummy conversion of its last channel, so the data register holds that
+// channel and the next command's read returns it too. After a failed scan
+// the register contents are unknown and nothing is published. adc -1
+// forgets both converters.
+static void adc_track(struct pcmmio_device *pmdev, int adc, int channel)
+{
+    if (adc < 0) {
+        memset(pmdev->adc_last, 0, sizeof(pmdev->adc_last));
+        memset(pmdev->adc_prev, 0, sizeof(pmdev->adc_prev));
+        return;
+    }
+
+    pmdev->adc_last[adc] = pmdev->adc_prev[adc] = channel + 1;
+}
+
+/* Convert a list of channels (0-15), results are stored in list order */
+static int adc_scan(struct pcmmio_device *pmdev, const unsigned char *channels, int count, unsigned short *data)
+{
+    int pending[2] = { -1, -1 };
+    int i, adc, ret;
+
+    for (i = 0; i < count; i++) {
+        adc = channels[i] / 8;
+
+        ret = adc_convert(pmdev, channels[i]);
+        if (ret)
+            goto out;
+
+        // This read returns the previous conversion on this converter
+        if (pending[adc] >= 0)
+            data[pending[adc]] = adc_read(pmdev, adc);
+
+        pending[adc] = i;
+    }
+
+    // A final dummy conversion is required to get out the last data
+    for (adc = 0; adc < 2; adc++) {
+        if (pending[adc] < 0)
+            continue;
+
+        ret = adc_convert(pmdev, channels[pending[adc]]);
+        if (ret)
+            goto out;
+
+        data[pending[adc]] = adc_read(pmdev, adc);
+
+        adc_track(pmdev, adc, channels[pending[adc]]);
+    }
+
+    state_adc(pmdev, channels, count, data);
+
+    ret = 0;
+
+out:
+    if (ret)
+        adc_track(pmdev, -1, 0);
+
+    trace_pcmmio_adc_scan(pmdev->name, count, ret);
+
+    return ret;
+}
+
+// Same as adc_scan but both converters run side by side. Each step starts
+// the next conversion on ADC1 and ADC2 back to back, waits for both and
+// reads both, so a 16 channel scan takes 9 conversion times instead of 18
+// and channels n and n+8 are sampled at nearly the same instant.
+static int adc_scan_parallel(struct pcmmio_device *pmdev, const unsigned char *channels, int count, unsigned short *data)
+{
+    unsigned char list[2][16];
+    int len[2] = { 0, 0 };
+    int i, adc, step, steps, ret;
+    bool active[2];
+
+    for (i = 0; i < count; i++) {
+        adc = channels[i] / 8;
+        list[adc][len[adc]++] = i;
+    }
+
+    // One extra step flushes the last result out of each converter
+    steps = max(len[0], len[1]) + 1;
+
+    for (step = 0; step < steps; step++) {
+        for (adc = 0; adc < 2; adc++) {
+            active[adc] = len[adc] && step <= len[adc];
+
+            if (active[adc])
+                mio_outb(pmdev, pmdev->adc_mode[channels[list[adc][min(step, len[adc] - 1)]]],
+                         ADC1_COMMAND + adc * 4);
+        }
+
+        for (adc = 0; adc < 2; adc++) {
+            if (!active[adc])
+                continue;
+
+            ret = adc_wait(pmdev, adc);
+            if (ret)
+                goto out;
+
+            if (step)
+                data[list[adc][step - 1]] = adc_read(pmdev, adc);
+        }
+    }
+
+    for (adc = 0; adc < 2; adc++)
+        if (len[adc])
+            adc_track(pmdev, adc, channels[list[adc][len[adc] - 1]]);
+
+    state_adc(pmdev, channels, count, data);
+
+    ret = 0;
+
+out:
+    if (ret)
+        adc_track(pmdev, -1, 0);
+
+    trace_pcmmio_adc_scan(pmdev->name, count, ret);
+
+    return ret;
+}
+
+// While a high priority file is open other scans run in slices, each
+// flushing its own conversion pipeline, with a chance for the high priority
+// file to get in between. A parallel slice takes channels n and n+8
+// together so each pair is still sampled at the same instant. The caller
+// holds pmdev->mtx, results are stored in list order.
+static int adc_scan_sliced(struct pcmmio_device *pmdev, const unsigned char *channels, int count,
+                           unsigned short *data, bool parallel, bool sliced)
+{
+    unsigned char sub[16], idx[16];
+    unsigned short out[16];
+    int i, n, lo, ret = 0, slices = 0;
+
+    if (!sliced)
+        return parallel ? adc_scan_parallel(pmdev, channels, count, data) :
+                          adc_scan(pmdev, channels, count, data);
+
+    if (!parallel) {
+        for (i = 0; i < count && !ret; i += ADC_SCAN_SLICE) {
+            if (i)
+                ioctl_yield(pmdev);
+
+            ret = adc_scan(pmdev, channels + i, min(ADC_SCAN_SLICE, count - i), data + i);
+        }
+
+        return ret;
+    }
+
+    for (lo = 0; lo < 8 && !ret; lo += ADC_SCAN_SLICE / 2) {
+        for (i = n = 0; i < count; i++) {
+            if (channels[i] % 8 < lo || channels[i] % 8 >= lo + ADC_SCAN_SLICE / 2)
+                continue;
+
+            sub[n] = channels[i];
+            idx[n++] = i;
+        }
+
+        if (!n)
+            continue;
+
+        if (slices++)
+            ioctl_yield(pmdev);
+
+        ret = adc_scan_parallel(pmdev, sub, n, out);
+
+        for (i = 0; !ret && i < n; i++)
+            data[idx[i]] = out[i];
+    }
+
+    return ret;
+}
+
+// ADC alarm monitor. While a period is set with ADC_MONITOR the channels
+// that have an alarm configured are scanned in the background, and an
+// event is queued only when one of them crosses a limit or comes back
+// inside it, so readers sleep through the normal case.
+
+/* Update the alarm state of a channel, returns true if it changed */
+static bool adc_check_alarm(struct pcmmio_device *pmdev, int channel, unsigned short raw)
+{
+    struct mio_adc_alarm *alarm = &pmdev->alarms[channel];
+    unsigned char state = pmdev->alarm_state[channel];
+    int value;
+
+    // Bipolar results are two's complement
+    if (pmdev->adc_mode[channel] & ADC_UNIPOLAR)
+        value = raw;
+    else
+        value = (s16) raw;
+
+    // An active alarm holds until the value is back past the hysteresis
+    if (state == MIO_ALARM_HIGH && value >= alarm->high - alarm->hysteresis)
+        return false;
+
+    if (state == MIO_ALARM_LOW && value <= alarm->low + alarm->hysteresis)
+        return false;
+
+    // Otherwise the limits decide afresh, so a window alarm can go from
+    // one side to the other in a single pass
+    if ((alarm->mode & MIO_ALARM_HIGH) && value > alarm->high)
+        state = MIO_ALARM_HIGH;
+    else if ((alarm->mode & MIO_ALARM_LOW) && value < alarm->low)
+        state = MIO_ALARM_LOW;
+    else
+        state = 0;
+
+    if (state == pmdev->alarm_state[channel])
+        return false;
+
+    pmdev->alarm_state[channel] = state;
+
+    return true;
+}
+
+static void adc_monitor_work(struct work_struct *work)
+{
+    struct pcmmio_device *pmdev = container_of(to_delayed_work(work), struct pcmmio_device, monitor);
+    struct mio_event ev = { 0 };
+    unsigned char channels[16];
+    unsigned short data[16];
+    int i, count, ret = 0, queued = 0;
+
+    // Background work stands aside for a high priority file like any
+    // normal priority command
+    prio_lock(pmdev);
+
+    for (i = count = 0; i < 16; i++)
+        if (pmdev->alarm_mask & (1 << i))
+            channels[count++] = i;
+
+    if (count)
+        ret = adc_scan_sliced(pmdev, channels, count, data, true, atomic_read(&pmdev->hp_clients));
+
+    ev.timestamp = ktime_get_ns();
+    ev.type = MIO_EVENT_ADC_ALARM;
+
+    for (i = 0; !ret && i < count; i++) {
+        if (!adc_check_alarm(pmdev, channels[i], data[i]))
+            continue;
+
+        ev.source = channels[i];
+        ev.value = data[i];
+        ev.flags = pmdev->alarm_state[channels[i]];
+
+        trace_pcmmio_adc_alarm(pmdev->name, ev.source, ev.value, ev.flags);
+
+        pmdev->alarms_raised++;
+
+        if (queue_event(pmdev, &ev))
+            queued++;
+    }
+
+    if (queued) {
+        pmdev->completions[ilog2(MIO_SRC_ALARM)]++;
+
+        if (pmdev->eventfd_mask & MIO_SRC_ALARM)
+            eventfd_notify(pmdev, MIO_SRC_ALARM);
+    }
+
+    if (pmdev->monitor_ms)
+        schedule_delayed_work(&pmdev->monitor, msecs_to_jiffies(pmdev->monitor_ms));
+
+    mutex_unlock(&pmdev->mtx);
+
+    if (queued)
+        wake_up_all(&pmdev->wq);
+}
+
+// ********************** IIO Support **********************
+//
+// The 16 ADC channels are also registered as an Industrial I/O device,
+// giving the standard buffered path: attach any IIO trigger and each
+// trigger runs a complete in-kernel scan of the enabled channels, which
+// is pushed with a timestamp to the kfifo behind /dev/iio:deviceN.
+// Samples are presented as offset binary, so bipolar channels report an
+// offset of -32768 and every channel uses the same unsigned scan type.
+
+#if IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+
+struct pcmmio_iio {
+    struct pcmmio_device *pmdev;
+    unsigned long scans;
+    struct {
+        unsigned short data[16];
+        s64 timestamp __aligned(8);
+    } scan;
+};
+
+#define PCMMIO_ADC_CHANNEL(__ch) {					\
+    .type = IIO_VOLTAGE,						\
+    .indexed = 1,							\
+    .channel = __ch,							\
+    .info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |			\
+                          BIT(IIO_CHAN_INFO_SCALE) |			\
+                          BIT(IIO_CHAN_INFO_OFFSET),			\
+    .scan_index = __ch,							\
+    .scan_type = {							\
+        .sign = 'u',							\
+        .realbits = 16,							\
+        .storagebits = 16,						\
+        .endianness = IIO_CPU,						\
+    },									\
+}
+
+static const struct iio_chan_spec adc_iio_channels[] = {
+    PCMMIO_ADC_CHANNEL(0), PCMMIO_ADC_CHANNEL(1), PCMMIO_ADC_CHANNEL(2),
+    PCMMIO_ADC_CHANNEL(3), PCMMIO_ADC_CHANNEL(4), PCMMIO_ADC_CHANNEL(5),
+    PCMMIO_ADC_CHANNEL(6), PCMMIO_ADC_CHANNEL(7), PCMMIO_ADC_CHANNEL(8),
+    PCMMIO_ADC_CHANNEL(9), PCMMIO_ADC_CHANNEL(10), PCMMIO_ADC_CHANNEL(11),
+    PCMMIO_ADC_CHANNEL(12), PCMMIO_ADC_CHANNEL(13), PCMMIO_ADC_CHANNEL(14),
+    PCMMIO_ADC_CHANNEL(15),
+    IIO_CHAN_SOFT_TIMESTAMP(16),
+};
+
+/* Bipolar results are two's complement, shift them to offset binary */
+static unsigned short adc_iio_value(struct pcmmio_device *pmdev, int channel, unsigned short raw)
+{
+    return (pmdev->adc_mode[channel] & ADC_UNIPOLAR) ? raw : raw ^ 0x8000;
+}
+
+/* Full scale span of a channel in millivolts */
+static int adc_iio_span(struct pcmmio_device *pmdev, int channel)
+{
+    unsigned char mode = pmdev->adc_mode[channel];
+    int span = (mode & ADC_TOP_10V) ? 10000 : 5000;
+
+    return (mode & ADC_UNIPOLAR) ? span : span * 2;
+}
+
+static int adc_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                            int *val, int *val2, long mask)
+{
+    struct pcmmio_device *pmdev = ((struct pcmmio_iio *) iio_priv(indio_dev))->pmdev;
+    unsigned char channel = chan->channel;
+    unsigned short data;
+    int ret;
+
+    switch (mask) {
+        case IIO_CHAN_INFO_RAW:
+            ret = iio_device_claim_direct_mode(indio_dev);
+            if (ret)
+                return ret;
+
+            prio_lock(pmdev);
+            ret = adc_scan(pmdev, &channel, 1, &data);
+            mutex_unlock(&pmdev->mtx);
+
+            iio_device_release_direct_mode(indio_dev);
+
+            if (ret)
+                return ret;
+
+            *val = adc_iio_value(pmdev, channel, data);
+            return IIO_VAL_INT;
+
+        case IIO_CHAN_INFO_SCALE:
+            *val = adc_iio_span(pmdev, channel);
+            *val2 = 16;
+            return IIO_VAL_FRACTIONAL_LOG2;
+
+        case IIO_CHAN_INFO_OFFSET:
+            *val = (pmdev->adc_mode[channel] & ADC_UNIPOLAR) ? 0 : -32768;
+            return IIO_VAL_INT;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+// Writing the offset selects unipolar (0) or bipolar (any other value).
+// Writing the scale selects the 5V or 10V top of range, whichever is closer.
+// The scale arrives in millivolts per LSB as val + val2 / 10^9, so the
+// midpoint between the two ranges is 1.5 times the 5V span in nano units.
+#define ADC_IIO_MIDSCALE(__span5) ((s64) (__span5) * 1500000000LL)
+
+static int adc_iio_write_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                             int val, int val2, long mask)
+{
+    struct pcmmio_device *pmdev = ((struct pcmmio_iio *) iio_priv(indio_dev))->pmdev;
+    int channel = chan->channel;
+    unsigned char mode;
+    s64 scale, span5;
+
+    mutex_lock(&pmdev->mtx);
+
+    mode = pmdev->adc_mode[channel];
+
+    switch (mask) {
+        case IIO_CHAN_INFO_OFFSET:
+            mode = val ? mode & ~ADC_UNIPOLAR : mode | ADC_UNIPOLAR;
+            break;
+
+        case IIO_CHAN_INFO_SCALE:
+            // The 5V scales read_raw reports, truncated to nano units as
+            // they come back from sysfs, must select 5V again and the 10V
+            // scales 10V
+            BUILD_BUG_ON(76293945LL * 65536 > ADC_IIO_MIDSCALE(5000));
+            BUILD_BUG_ON(152587890LL * 65536 > ADC_IIO_MIDSCALE(10000));
+            BUILD_BUG_ON(152587890LL * 65536 <= ADC_IIO_MIDSCALE(5000));
+            BUILD_BUG_ON(305175781LL * 65536 <= ADC_IIO_MIDSCALE(10000));
+
+            // Compare in nano units per LSB against the midpoint of the choices
+            scale = (s64) val * 1000000000 + val2;
+            span5 = (mode & ADC_UNIPOLAR) ? 5000 : 10000;
+            if (scale * 65536 > ADC_IIO_MIDSCALE(span5))
+                mode |= ADC_TOP_10V;
+            else
+                mode &= ~ADC_TOP_10V;
+            break;
+
+        default:
+            mutex_unlock(&pmdev->mtx);
+            return -EINVAL;
+    }
+
+    pmdev->adc_mode[channel] = mode;
+
+    mutex_unlock(&pmdev->mtx);
+
+    return 0;
+}
+
+static int adc_iio_write_raw_get_fmt(struct iio_dev *indio_dev, struct iio_chan_spec const *chan, long mask)
+{
+    return mask == IIO_CHAN_INFO_SCALE ? IIO_VAL_INT_PLUS_NANO : IIO_VAL_INT;
+}
+
+static const struct iio_info adc_iio_info = {
+    .read_raw = adc_iio_read_raw,
+    .write_raw = adc_iio_write_raw,
+    .write_raw_get_fmt = adc_iio_write_raw_get_fmt,
+};
+
+/* Runs in the trigger's thread, one complete scan per trigger */
+static irqreturn_t adc_iio_trigger_handler(int irq, void *p)
+{
+    struct iio_poll_func *pf = p;
+    struct iio_dev *indio_dev = pf->indio_dev;
+    struct pcmmio_iio *priv = iio_priv(indio_dev);
+    struct pcmmio_device *pmdev = priv->pmdev;
+    unsigned char channels[16];
+    int i, count = 0;
+    int ret;
+
+    for_each_set_bit(i, indio_dev->active_scan_mask, 16)
+        channels[count++] = i;
+
+    prio_lock(pmdev);
+    ret = adc_scan_sliced(pmdev, channels, count, priv->scan.data, true, atomic_read(&pmdev->hp_clients));
+    mutex_unlock(&pmdev->mtx);
+
+    if (!ret) {
+        for (i = 0; i < count; i++)
+            priv->scan.data[i] = adc_iio_value(pmdev, channels[i], priv->scan.data[i]);
+
+        ret = iio_push_to_buffers_with_timestamp(indio_dev, &priv->scan, pf->timestamp);
+    }
+
+    trace_pcmmio_buffer_push(pmdev->name, ++priv->scans, count, ret);
+
+    iio_trigger_notify_done(indio_dev->trig);
+
+    return IRQ_HANDLED;
+}
+
+static void iio_init(struct pcmmio_device *pmdev)
+{
+    struct iio_dev *indio_dev;
+    int ret;
+
+    indio_dev = iio_device_alloc(sizeof(struct pcmmio_iio));
+    if (!indio_dev) {
+        pr_warning("[%s] Unable to allocate IIO device\n", pmdev->name);
+        return;
+    }
+
+    ((struct pcmmio_iio *) iio_priv(indio_dev))->pmdev = pmdev;
+
+    indio_dev->dev.parent = IS_ERR_OR_NULL(pmdev->dev) ? NULL : pmdev->dev;
+    indio_dev->name = pmdev->name;
+    indio_dev->info = &adc_iio_info;
+    indio_dev->modes = INDIO_DIRECT_MODE;
+    indio_dev->channels = adc_iio_channels;
+    indio_dev->num_channels = ARRAY_SIZE(adc_iio_channels);
+
+    ret = iio_triggered_buffer_setup(indio_dev, iio_pollfunc_store_time, adc_iio_trigger_handler, NULL);
+    if (ret)
+        goto err_free;
+
+    ret = iio_device_register(indio_dev);
+    if (ret)
+        goto err_buffer;
+
+    pmdev->iio = indio_dev;
+
+    return;
+
+err_buffer:
+    iio_triggered_buffer_cleanup(indio_dev);
+err_free:
+    iio_device_free(indio_dev);
+    pr_warning("[%s] Unable to register IIO device (%d)\n", pmdev->name, ret);
+}
+
+static void iio_exit(struct pcmmio_device *pmdev)
+{
+    if (!pmdev->iio)
+        return;
+
+    iio_device_unregister(pmdev->iio);
+    iio_triggered_buffer_cleanup(pmdev->iio);
+    iio_device_free(pmdev->iio);
+
+    pmdev->iio = NULL;
+}
+
+#else
+
+static void iio_init(struct pcmmio_device *pmdev)
+{
+}
+
+static void iio_exit(struct pcmmio_device *pmdev)
+{
+}
+
+#endif /* CONFIG_IIO_TRIGGERED_BUFFER */
+
+// ********************** Statistics **********************
+
+static void hist_add(struct pcmmio_hist *hist, u64 value)
+{
+    int bucket = min_t(int, fls64(value), HIST_BUCKETS - 1);
+    u64 old;
+
+    atomic_long_inc(&hist->bucket[bucket]);
+    atomic64_add(value, &hist->sum);
+
+    // Lockless maximum, retry only if someone raced us upwards
+    while (value > (old = atomic64_read(&hist->max)))
+        if (atomic64_cmpxchg(&hist->max, old, value) == old)
+            break;
+}
+
+static void hist_reset(struct pcmmio_hist *hist)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        atomic_long_set(&hist->bucket[i], 0);
+
+    atomic64_set(&hist->sum, 0);
+    atomic64_set(&hist->max, 0);
+}
+
+static void hist_show(struct seq_file *m, struct pcmmio_hist *hist)
+{
+    unsigned long count, total = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        count = atomic_long_read(&hist->bucket[i]);
+        total += count;
+
+        if (count)
+            seq_printf(m, "%12llu - %12llu ns : %lu\n",
+                       i ? 1ULL << (i - 1) : 0ULL, (1ULL << i) - 1, count);
+    }
+
+    seq_printf(m, "count %lu\n", total);
+    seq_printf(m, "avg   %llu ns\n",
+               total ? div64_u64(atomic64_read(&hist->sum), total) : 0ULL);
+    seq_printf(m, "max   %llu ns\n", (unsigned long long) atomic64_read(&hist->max));
+}
+
+static int hist_seq_show(struct seq_file *m, void *v)
+{
+    hist_show(m, m->private);
+    return 0;
+}
+
+static int hist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hist_seq_show, inode->i_private);
+}
+
+/* Any write to a histogram file clears it */
+static ssize_t hist_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+
+    hist_reset(m->private);
+
+    return count;
+}
+
+static const struct file_operations hist_fops = {
+    owner:			THIS_MODULE,
+    open:			hist_open,
+    read:			seq_read,
+    write:			hist_write,
+    llseek:			seq_lseek,
+    release:		single_release,
+};
+
+static void debugfs_create_hist(const char *name, struct dentry *parent, struct pcmmio_hist *hist)
+{
+    debugfs_create_file(name, 0644, parent, hist, &hist_fops);
+}
+
+// Debugfs names for the ioctl statistics, indexed by command number
+static const char * const ioctl_names[IOCTL_STATS] = {
+    [_IOC_NR(ADC_WRITE_COMMAND)] = "adc_write_command",
+    [_IOC_NR(ADC_READ_DATA)] = "adc_read_data",
+    [_IOC_NR(ADC_READ_STATUS)] = "adc_read_status",
+    [_IOC_NR(ADC1_WAIT_INT)] = "adc1_wait_int",
+    [_IOC_NR(ADC2_WAIT_INT)] = "adc2_wait_int",
+    [_IOC_NR(DAC_WRITE_DATA)] = "dac_write_data",
+    [_IOC_NR(DAC_READ_STATUS)] = "dac_read_status",
+    [_IOC_NR(DAC_WRITE_COMMAND)] = "dac_write_command",
+    [_IOC_NR(DAC1_WAIT_INT)] = "dac1_wait_int",
+    [_IOC_NR(DAC2_WAIT_INT)] = "dac2_wait_int",
+    [_IOC_NR(DIO_WRITE_BYTE)] = "dio_write_byte",
+    [_IOC_NR(DIO_READ_BYTE)] = "dio_read_byte",
+    [_IOC_NR(DIO_WAIT_INT)] = "dio_wait_int",
+    [_IOC_NR(DIO_GET_INT)] = "dio_get_int",
+    [_IOC_NR(MIO_WRITE_REG)] = "mio_write_reg",
+    [_IOC_NR(MIO_READ_REG)] = "mio_read_reg",
+    [_IOC_NR(ADC_SCAN)] = "adc_scan",
+    [_IOC_NR(DIO_ADD_RULE)] = "dio_add_rule",
+    [_IOC_NR(DIO_CLEAR_RULES)] = "dio_clear_rules",
+    [_IOC_NR(ADC_SET_ALARM)] = "adc_set_alarm",
+    [_IOC_NR(ADC_MONITOR)] = "adc_monitor",
+    [_IOC_NR(MIO_WAIT)] = "mio_wait",
+    [_IOC_NR(MIO_SET_EVENTFD)] = "mio_set_eventfd",
+    [_IOC_NR(DIO_SET_QUAD)] = "dio_set_quad",
+    [_IOC_NR(DIO_GET_QUAD)] = "dio_get_quad",
+    [_IOC_NR(DIO_BOTH_EDGES)] = "dio_both_edges",
+    [_IOC_NR(DIO_SET_PWM)] = "dio_set_pwm",
+    [_IOC_NR(DIO_SCAN)] = "dio_scan",
+    [_IOC_NR(MIO_SET_PRIORITY)] = "mio_set_priority",
+    [_IOC_NR(MIO_GET_CONFIG)] = "mio_get_config",
+};
+
+/* One directory per command holding its lock_wait and service histograms */
+static void debugfs_create_ioctl_stats(struct pcmmio_device *pmdev)
+{
+    struct dentry *ioctl_dir, *dir;
+    int i;
+
+    ioctl_dir = debugfs_create_dir("ioctl", pmdev->debug_dir);
+
+    for (i = 0; i < IOCTL_STATS; i++) {
+        if (!ioctl_names[i])
+            continue;
+
+        dir = debugfs_create_dir(ioctl_names[i], ioctl_dir);
+        debugfs_create_hist("lock_wait", dir, &pmdev->ioctl_stats[i].lock_wait);
+        debugfs_create_hist("service", dir, &pmdev->ioctl_stats[i].service);
+    }
+}
+
+static int counters_show(struct seq_file *m, void *v)
+{
+    struct pcmmio_device *pmdev = m->private;
+    int i;
+
+    seq_printf(m, "irqs        %lu\n", pmdev->irq_count);
+    seq_printf(m, "queued      %d\n", PCMMIO_INT_DEPTH(pmdev));
+    seq_printf(m, "dropped     %lu\n", pmdev->events_dropped);
+    seq_printf(m, "rules       %d\n", pmdev->rule_count);
+    seq_printf(m, "rules_fired %lu\n", pmdev->rules_fired);
+    seq_printf(m, "alarms      %lu\n", pmdev->alarms_raised);
+    seq_printf(m, "hp_files    %d\n", atomic_read(&pmdev->hp_clients));
+    seq_printf(m, "yields      %lu\n", pmdev->yields);
+
+    if (ktime_to_ns(pmdev->poll_period))
+        seq_printf(m, "polls       %lu\n", pmdev->polls);
+
+    seq_printf(m, "storms      %lu\n", pmdev->storms);
+    seq_printf(m, "recoveries  %lu\n", pmdev->storm_recoveries);
+    seq_printf(m, "storm_edges %lu\n", pmdev->storm_polled);
+    seq_printf(m, "storm_mask  %06x\n", pmdev->storm_mask);
+
+    for (i = 0; i < MAX_QUAD; i++)
+        if (pmdev->quad[i].bit_a != pmdev->quad[i].bit_b)
+            seq_printf(m, "quad%-7d %lld errors %u\n", i,
+                       (long long) pmdev->quad[i].position, pmdev->quad[i].errors);
+
+    if (ktime_to_ns(pmdev->scan_period)) {
+        seq_printf(m, "scans       %lu\n", pmdev->scans);
+        seq_printf(m, "scan_edges  %lu\n", pmdev->scan_changes);
+    }
+
+    if (pmdev->pwm_bits) {
+        seq_printf(m, "pwm_bits    %012llx\n", (unsigned long long) pmdev->pwm_bits);
+        seq_printf(m, "pwm_edges   %lu\n", pmdev->pwm_edges);
+        seq_printf(m, "pwm_writes  %lu\n", pmdev->pwm_writes);
+    }
+
+    if (pmdev->sim)
+        sim_show_counters(m, pmdev);
+
+    return 0;
+}
+
+static int counters_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, counters_show, inode->i_private);
+}
+
+static const struct file_operations counters_fops = {
+    owner:			THIS_MODULE,
+    open:			counters_open,
+    read:			seq_read,
+    llseek:			seq_lseek,
+    release:		single_release,
+};
+
+static void debugfs_create_counters(struct pcmmio_device *pmdev)
+{
+    debugfs_create_file("counters", 0444, pmdev->debug_dir, pmdev, &counters_fops);
+}
+
+// ********************** Flight Recorder **********************
+//
+// Every register write, ioctl, decoded interrupt and DIO event is kept in
+// a small overwrite-oldest ring per CPU, so after a trip the last few
+// thousand operations can be read back from debugfs "flight". Writers
+// only touch their own CPU's ring with a local_t, nothing is shared with
+// device_ioctl or irq_handler. The dump merges the rings by timestamp. It
+// does not stop the writers, so a record being written during the dump
+// may come out torn.
+
+static const char *const flight_names[] = {
+    [FLIGHT_OUTB] = "outb",
+    [FLIGHT_OUTW] = "outw",
+    [FLIGHT_IOCTL] = "ioctl",
+    [FLIGHT_IRQ] = "irq",
+    [FLIGHT_DIO] = "dio",
+};
+
+struct flight_dump {
+    struct pcmmio_record rec;
+    int cpu;
+};
+
+static int flight_cmp(const void *a, const void *b)
+{
+    u64 ta = ((const struct flight_dump *) a)->rec.timestamp;
+    u64 tb = ((const struct flight_dump *) b)->rec.timestamp;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+static int flight_show(struct seq_file *m, void *v)
+{
+    struct pcmmio_device *pmdev = m->private;
+    struct pcmmio_flight *flight;
+    struct flight_dump *dump;
+    unsigned long head, n;
+    int cpu, count = 0, i;
+
+    if (!pmdev->flight)
+        return 0;
+
+    dump = vmalloc(num_possible_cpus() * FLIGHT_RECORDS * sizeof(*dump));
+    if (!dump)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        flight = per_cpu_ptr(pmdev->flight, cpu);
+        head = local_read(&flight->head);
+
+        for (n = head > FLIGHT_RECORDS ? head - FLIGHT_RECORDS : 0; n < head; n++) {
+            dump[count].rec = flight->rec[n & (FLIGHT_RECORDS - 1)];
+            dump[count].cpu = cpu;
+            count++;
+        }
+    }
+
+    sort(dump, count, sizeof(*dump), flight_cmp, NULL);
+
+    for (i = 0; i < count; i++) {
+        struct pcmmio_record *rec = &dump[i].rec;
+
+        seq_printf(m, "%llu cpu%d %-5s %02x %x\n",
+                   (unsigned long long) rec->timestamp, dump[i].cpu,
+                   rec->type < ARRAY_SIZE(flight_names) ? flight_names[rec->type] : "?",
+                   rec->reg, rec->value);
+    }
+
+    vfree(dump);
+
+    return 0;
+}
+
+static int flight_open(struct inode *inode, struct file *file)
+{
+    struct pcmmio_device *pmdev = inode->i_private;
+
+    // The whole dump is formatted at once, size the buffer up front
+    return single_open_size(file, flight_show, pmdev,
+                            num_possible_cpus() * FLIGHT_RECORDS * 48);
+}
+
+static const struct file_operations flight_fops = {
+    owner:			THIS_MODULE,
+    open:			flight_open,
+    read:			seq_read,
+    llseek:			seq_lseek,
+    release:		single_release,
+};
+
+static void debugfs_create_flight(struct pcmmio_device *pmdev)
+{
+    debugfs_create_file("flight", 0400, pmdev->debug_dir, pmdev, &flight_fops);
+}
+
+// ********************** Simulated Hardware **********************
+//
+// When a device is loaded with sim=1 its registers are backed by the model
+// below instead of the ISA bus. The model follows the register map in
+// mio_io.h closely enough for the driver and the user library to run
+// unmodified: the ADCs return the previous conversion like the real parts,
+// the DACs latch spans and codes, and the DIO block implements the paged
+// polarity/enable/ID registers. An hrtimer toggles DIO inputs at sim_rate
+// edges per second and raises interrupts exactly as the card would, so the
+// ISR, event ring and wakeup paths can be exercised and measured anywhere.
+
+// Time taken by a simulated ADC or DAC conversion
+#define SIM_CONVERT_NS  4000
+
+// Fastest edge rate, a shorter timer period would starve the CPU
+#define SIM_MAX_RATE    (USEC_PER_SEC / MIN_SCAN_PERIOD)
+
+struct pcmmio_sim {
+    spinlock_t lock;                    // register state
+    spinlock_t line;                    // serializes the ISR like a real IRQ line
+    struct pcmmio_device *pmdev;
+    struct hrtimer edge_timer;          // synthetic DIO input edges
+    struct hrtimer done_timer;          // ADC/DAC conversion completion
+    ktime_t period;
+    unsigned char busy;                 // conversions in progress, DAC2_IRQ_REG layout
+    unsigned char irq_status;           // DAC2_IRQ_REG, DIO bit is derived
+    unsigned char adc_rsrc[2];
+    unsigned char adc_status[2];
+    unsigned char adc_channel[2];       // channel of the conversion in progress
+    unsigned short adc_data[2];
+    unsigned char dac_rsrc[2];
+    unsigned char dac_status[2];
+    unsigned short dac_data[2];
+    unsigned short dac_span[8];
+    unsigned short dac_code[8];
+    unsigned char dio_out[6];
+    unsigned char dio_in[6];
+    unsigned char page;
+    unsigned char polarity[3];
+    unsigned char enable[3];
+    unsigned char int_id[3];
+    unsigned next_bit;
+    unsigned long edges;
+};
+
+/* Synthetic input, a ramp per channel offset so channels are distinguishable */
+static unsigned short sim_sample(unsigned char channel)
+{
+    return (unsigned short) ((ktime_get_ns() >> 10) + channel * 0x1000);
+}
+
+static unsigned char sim_irq_status(struct pcmmio_sim *sim)
+{
+    unsigned char status = sim->irq_status;
+
+    // The DIO request stays asserted while any ID latch is set
+    if ((sim->int_id[0] | sim->int_id[1] | sim->int_id[2]) && (sim->adc_rsrc[0] & 0x01))
+        status |= 0x08;
+
+    return status;
+}
+
+/* Deliver the interrupt, the ISR acknowledges through the register model */
+static void sim_interrupt(struct pcmmio_sim *sim)
+{
+    unsigned long flags;
+    unsigned char status;
+    int loops = 8;
+
+    do {
+        spin_lock_irqsave(&sim->lock, flags);
+        status = sim_irq_status(sim);
+        spin_unlock_irqrestore(&sim->lock, flags);
+
+        if (!status)
+            break;
+
+        spin_lock_irqsave(&sim->line, flags);
+        irq_handler(0, sim->pmdev);
+        spin_unlock_irqrestore(&sim->line, flags);
+    } while (--loops);
+}
+
+static enum hrtimer_restart sim_done_timer(struct hrtimer *timer)
+{
+    struct pcmmio_sim *sim = container_of(timer, struct pcmmio_sim, done_timer);
+    unsigned long flags;
+    int i;
+
+    spin_lock_irqsave(&sim->lock, flags);
+
+    for (i = 0; i < 2; i++) {
+        if (sim->busy & (1 << i)) {
+            sim->adc_status[i] |= 0x80;
+            if (sim->adc_rsrc[i] & 0x01)
+                sim->irq_status |= 1 << i;
+        }
+    }
+
+    // DAC1 completes on bit 2 and DAC2 on bit 4 of the IRQ register
+    for (i = 0; i < 2; i++) {
+        unsigned char bit = i ? 0x10 : 0x04;
+
+        if (sim->busy & bit) {
+            sim->dac_status[i] |= DAC_BUSY;
+            if (sim->dac_rsrc[i] & 0x01)
+                sim->irq_status |= bit;
+        }
+    }
+
+    sim->busy = 0;
+
+    spin_unlock_irqrestore(&sim->lock, flags);
+
+    sim_interrupt(sim);
+
+    return HRTIMER_NORESTART;
+}
+
+static enum hrtimer_restart sim_edge_timer(struct hrtimer *timer)
+{
+    struct pcmmio_sim *sim = container_of(timer, struct pcmmio_sim, edge_timer);
+    unsigned char mask, level;
+    unsigned long flags;
+    int port;
+
+    spin_lock_irqsave(&sim->lock, flags);
+
+    // Walk the 24 interrupt capable inputs, toggling one per tick
+    port = sim->next_bit / 8;
+    mask = 1 << (sim->next_bit % 8);
+    sim->next_bit = (sim->next_bit + 1) % 24;
+
+    sim->dio_in[port] ^= mask;
+    level = sim->dio_in[port] & mask;
+    sim->edges++;
+
+    // Polarity 1 selects the falling edge, 0 the rising edge
+    if ((sim->enable[port] & mask) && (!level == !!(sim->polarity[port] & mask)))
+        sim->int_id[port] |= mask;
+
+    spin_unlock_irqrestore(&sim->lock, flags);
+
+    sim_interrupt(sim);
+
+    hrtimer_forward_now(timer, sim->period);
+
+    return HRTIMER_RESTART;
+}
+
+static void sim_start_conversion(struct pcmmio_sim *sim, unsigned char bit)
+{
+    sim->busy |= bit;
+    hrtimer_start(&sim->done_timer, ns_to_ktime(SIM_CONVERT_NS), HRTIMER_MODE_REL);
+}
+
+static void sim_dac_command(struct pcmmio_sim *sim, int dac, unsigned char command)
+{
+    int cmd = command >> 4;
+    int channel = dac * 4 + ((command >> 1) & 0x3);
+    int i;
+
+    switch (cmd) {
+        case DAC_CMD_WR_B1_SPAN:
+        case DAC_CMD_WR_UPDATE_SPAN:
+            sim->dac_span[channel] = sim->dac_data[dac];
+            break;
+
+        case DAC_CMD_WR_B1_CODE:
+        case DAC_CMD_WR_UPDATE_CODE:
+            sim->dac_code[channel] = sim->dac_data[dac];
+            break;
+
+        case DAC_CMD_WR_SPAN_UPDATE_ALL:
+            for (i = 0; i < 4; i++)
+                sim->dac_span[dac * 4 + i] = sim->dac_data[dac];
+            break;
+
+        case DAC_CMD_WR_CODE_UPDATE_ALL:
+            for (i = 0; i < 4; i++)
+                sim->dac_code[dac * 4 + i] = sim->dac_data[dac];
+            break;
+    }
+
+    sim->dac_status[dac] &= ~DAC_BUSY;
+    sim_start_conversion(sim, dac ? 0x10 : 0x04);
+}
+
+static unsigned char sim_inb(struct pcmmio_device *pmdev, unsigned reg)
+{
+    struct pcmmio_sim *sim = pmdev->sim;
+    unsigned char val = 0;
+    unsigned long flags;
+    int n;
+
+    spin_lock_irqsave(&sim->lock, flags);
+
+    switch (reg) {
+        case ADC1_DATA_LO:
+        case ADC2_DATA_LO:
+            val = sim->adc_data[reg / 4] & 0xff;
+            break;
+
+        case ADC1_DATA_HI:
+        case ADC2_DATA_HI:
+            // Reading the high byte acknowledges the ADC interrupt
+            n = reg / 4;
+            val = sim->adc_data[n] >> 8;
+            sim->irq_status &= ~(1 << n);
+            break;
+
+        case ADC1_STATUS:
+        case ADC2_STATUS:
+            val = sim->adc_status[reg / 4];
+            break;
+
+        case DAC1_DATA_LO:
+        case DAC2_DATA_LO:
+            val = sim->dac_data[(reg - DAC1_DATA_LO) / 4] & 0xff;
+            break;
+
+        case DAC1_DATA_HI:
+        case DAC2_DATA_HI:
+            n = (reg - DAC1_DATA_LO) / 4;
+            val = sim->dac_data[n] >> 8;
+            sim->irq_status &= n ? ~0x10 : ~0x04;
+            break;
+
+        case DAC1_STATUS:
+            val = sim->dac_status[0];
+            break;
+
+        case DAC2_STATUS:
+            // Reg15[5] selects the interrupt ID register
+            if (sim->dac_rsrc[1] & 0x20)
+                val = sim_irq_status(sim);
+            else
+                val = sim->dac_status[1];
+            break;
+
+        case DIO_PORT0 ... DIO_PORT5:
+            n = reg - DIO_PORT0;
+            val = sim->dio_in[n] | sim->dio_out[n];
+            break;
+
+        case DIO_INT_PENDING:
+            for (n = 0; n < 3; n++)
+                if (sim->int_id[n])
+                    val |= 1 << n;
+            break;
+
+        case DIO_PAGE_LOCK:
+            val = sim->page;
+            break;
+
+        case DIO_ENABLE0 ... DIO_ENABLE2:
+            n = reg - DIO_ENABLE0;
+            if (sim->page == PAGE1)
+                val = sim->polarity[n];
+            else if (sim->page == PAGE2)
+                val = sim->enable[n];
+            else if (sim->page == PAGE3)
+                val = sim->int_id[n];
+            break;
+    }
+
+    spin_unlock_irqrestore(&sim->lock, flags);
+
+    return val;
+}
+
+static void sim_outb(struct pcmmio_device *pmdev, unsigned char val, unsigned reg)
+{
+    struct pcmmio_sim *sim = pmdev->sim;
+    unsigned long flags;
+    int n;
+
+    spin_lock_irqsave(&sim->lock, flags);
+
+    switch (reg) {
+        case ADC1_COMMAND:
+        case ADC2_COMMAND:
+            n = reg / 4;
+
+            // Reg3[4:3] and Reg7[3] redirect this address to the resource registers
+            if (sim->adc_rsrc[n] & 0x18)
+                break;
+
+            // The data register holds the result of the previous conversion
+            sim->adc_data[n] = sim_sample(n * 8 + sim->adc_channel[n]);
+            sim->adc_channel[n] = ((val >> 3) & 0x6) | ((val >> 6) & 0x1);
+            sim->adc_status[n] &= ~0x80;
+            sim_start_conversion(sim, 1 << n);
+            break;
+
+        case ADC1_RSRC_ENBL:
+        case ADC2_RSRC_ENBL:
+            sim->adc_rsrc[reg / 4] = val;
+            break;
+
+        case DAC1_DATA_LO:
+        case DAC2_DATA_LO:
+            n = (reg - DAC1_DATA_LO) / 4;
+            sim->dac_data[n] = (sim->dac_data[n] & 0xff00) | val;
+            break;
+
+        case DAC1_DATA_HI:
+        case DAC2_DATA_HI:
+            n = (reg - DAC1_DATA_LO) / 4;
+            sim->dac_data[n] = (sim->dac_data[n] & 0x00ff) | (val << 8);
+            break;
+
+        case DAC1_COMMAND:
+        case DAC2_COMMAND:
+            n = (reg - DAC1_DATA_LO) / 4;
+
+            if (sim->dac_rsrc[n] & 0x08)
+                break;
+
+            sim_dac_command(sim, n, val);
+            break;
+
+        case DAC1_RSRC_ENBL:
+        case DAC2_RSRC_ENBL:
+            sim->dac_rsrc[(reg - DAC1_DATA_LO) / 4] = val;
+            break;
+
+        case DIO_PORT0 ... DIO_PORT5:
+            sim->dio_out[reg - DIO_PORT0] = val;
+            break;
+
+        case DIO_PAGE_LOCK:
+            sim->page = val & 0xc0;
+            break;
+
+        case DIO_ENABLE0 ... DIO_ENABLE2:
+            n = reg - DIO_ENABLE0;
+            if (sim->page == PAGE1) {
+                sim->polarity[n] = val;
+            } else if (sim->page == PAGE2) {
+                // Dropping an enable clears its latched interrupt
+                sim->enable[n] = val;
+                sim->int_id[n] &= val;
+            }
+            break;
+    }
+
+    spin_unlock_irqrestore(&sim->lock, flags);
+}
+
+static unsigned short sim_inw(struct pcmmio_device *pmdev, unsigned reg)
+{
+    return sim_inb(pmdev, reg) | (sim_inb(pmdev, reg + 1) << 8);
+}
+
+static void sim_outw(struct pcmmio_device *pmdev, unsigned short val, unsigned reg)
+{
+    sim_outb(pmdev, val & 0xff, reg);
+    sim_outb(pmdev, val >> 8, reg + 1);
+}
+
+static int sim_init(struct pcmmio_device *pmdev, unsigned rate)
+{
+    struct pcmmio_sim *sim;
+
+    sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+    if (!sim)
+        return -ENOMEM;
+
+    if (rate > SIM_MAX_RATE) {
+        pr_warning("[%s] sim_rate %u limited to %u\n", pmdev->name, rate, (unsigned) SIM_MAX_RATE);
+        rate = SIM_MAX_RATE;
+    }
+
+    spin_lock_init(&sim->lock);
+    spin_lock_init(&sim->line);
+    sim->pmdev = pmdev;
+    sim->adc_status[0] = sim->adc_status[1] = 0x80;
+    sim->dac_status[0] = sim->dac_status[1] = DAC_BUSY;
+    sim->period = ns_to_ktime(rate ? div_u64(NSEC_PER_SEC, rate) : 0);
+
+    hrtimer_init(&sim->done_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    sim->done_timer.function = sim_done_timer;
+
+    hrtimer_init(&sim->edge_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    sim->edge_timer.function = sim_edge_timer;
+
+    pmdev->sim = sim;
+
+    return 0;
+}
+
+static void sim_start(struct pcmmio_device *pmdev)
+{
+    struct pcmmio_sim *sim = pmdev->sim;
+
+    if (ktime_to_ns(sim->period))
+        hrtimer_start(&sim->edge_timer, sim->period, HRTIMER_MODE_REL);
+
+    pr_info("[%s] Simulated device, %lld ns between DIO edges\n", pmdev->name,
+            (long long) ktime_to_ns(sim->period));
+}
+
+/* Stop the synthetic edges, register access keeps working until sim_exit */
+static void sim_stop(struct pcmmio_device *pmdev)
+{
+    hrtimer_cancel(&pmdev->sim->edge_timer);
+}
+
+static void sim_exit(struct pcmmio_device *pmdev)
+{
+    struct pcmmio_sim *sim = pmdev->sim;
+
+    hrtimer_cancel(&sim->edge_timer);
+    hrtimer_cancel(&sim->done_timer);
+
+    pmdev->sim = NULL;
+    kfree(sim);
+}
+
+static void sim_show_counters(struct seq_file *m, struct pcmmio_device *pmdev)
+{
+    seq_printf(m, "sim_edges   %lu\n", pmdev->sim->edges);
+}
+
+// ********************** GPIO Support **********************
+//
+// Each card registers a 48 line gpio_chip so the DIO can be driven through
+// the GPIO character device (libgpiod) as well as through our ioctls. Both
+// paths share port_images. Lines 0-23 (DIO bits 1-24) can also interrupt;
+// they are exposed through an irqchip built on the page 1 polarity and
+// page 2 enable registers, and are dispatched from irq_handler after
+// get_int() has decoded and clr_int() has cleared the bit.
+
+#ifdef CONFIG_GPIOLIB
+
+static int gpio_get(struct gpio_chip *gc, unsigned offset)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(gc);
+
+    return !!(mio_inb(pmdev, DIO_PORT0 + offset / 8) & (1 << (offset % 8)));
+}
+
+/* One port read per byte that has any requested line */
+static int gpio_get_multiple(struct gpio_chip *gc, unsigned long *mask, unsigned long *bits)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(gc);
+    unsigned long port_mask, val;
+    int port, shift;
+
+    for (port = 0; port < 6; port++) {
+        shift = (port * 8) % BITS_PER_LONG;
+        port_mask = (mask[BIT_WORD(port * 8)] >> shift) & 0xff;
+
+        if (!port_mask)
+            continue;
+
+        val = mio_inb(pmdev, DIO_PORT0 + port) & port_mask;
+
+        bits[BIT_WORD(port * 8)] &= ~(port_mask << shift);
+        bits[BIT_WORD(port * 8)] |= val << shift;
+    }
+
+    return 0;
+}
+
+static void gpio_set(struct gpio_chip *gc, unsigned offset, int value)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(gc);
+    unsigned char mask = 1 << (offset % 8);
+    int port = offset / 8;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    if (value)
+        __dio_write_port(pmdev, port, pmdev->port_images[port] | mask);
+    else
+        __dio_write_port(pmdev, port, pmdev->port_images[port] & ~mask);
+
+    state_outputs(pmdev);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+/* Coalesce the update into a single write per touched port */
+static void gpio_set_multiple(struct gpio_chip *gc, unsigned long *mask, unsigned long *bits)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(gc);
+    unsigned long port_mask, val, flags;
+    int port, shift;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    for (port = 0; port < 6; port++) {
+        shift = (port * 8) % BITS_PER_LONG;
+        port_mask = (mask[BIT_WORD(port * 8)] >> shift) & 0xff;
+
+        if (!port_mask)
+            continue;
+
+        val = (bits[BIT_WORD(port * 8)] >> shift) & port_mask;
+
+        __dio_write_port(pmdev, port, (pmdev->port_images[port] & ~port_mask) | val);
+    }
+
+    state_outputs(pmdev);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+// A line is an output while its image bit is set. Writing a zero turns the
+// output off, which is also how the hardware makes a line an input.
+static int gpio_get_direction(struct gpio_chip *gc, unsigned offset)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(gc);
+
+    return !(pmdev->port_images[offset / 8] & (1 << (offset % 8)));
+}
+
+static int gpio_direction_input(struct gpio_chip *gc, unsigned offset)
+{
+    gpio_set(gc, offset, 0);
+    return 0;
+}
+
+static int gpio_direction_output(struct gpio_chip *gc, unsigned offset, int value)
+{
+    gpio_set(gc, offset, value);
+    return 0;
+}
+
+#ifdef CONFIG_GPIOLIB_IRQCHIP
+
+/* Update one bit of a paged DIO register, page 1 polarity or page 2 enable */
+static void gpio_update_paged(struct pcmmio_device *pmdev, unsigned char page, unsigned hwirq, bool set)
+{
+    unsigned char mask = 1 << (hwirq % 8);
+    unsigned reg = DIO_ENABLE0 + hwirq / 8;
+    unsigned char temp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    mio_outb(pmdev, page, DIO_PAGE_LOCK);
+
+    temp = mio_inb(pmdev, reg);
+    temp = set ? temp | mask : temp & ~mask;
+    mio_outb(pmdev, temp, reg);
+
+    // Restore page 3 register access
+    mio_outb(pmdev, PAGE3, DIO_PAGE_LOCK);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+static void gpio_irq_mask(struct irq_data *d)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(irq_data_get_irq_chip_data(d));
+
+    clear_bit(d->hwirq, &pmdev->gpio_irq_enabled);
+    gpio_update_paged(pmdev, PAGE2, d->hwirq, false);
+}
+
+// A bit masked for storming keeps its enable clear, storm_poll sets it
+// again once the bit is quiet
+static void gpio_irq_unmask(struct irq_data *d)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(irq_data_get_irq_chip_data(d));
+
+    unsigned long flags;
+
+    set_bit(d->hwirq, &pmdev->gpio_irq_enabled);
+
+    spin_lock_irqsave(&pmdev->spnlck, flags);
+
+    if (!(pmdev->storm_mask & (1 << d->hwirq)))
+        dio_set_enable(pmdev, d->hwirq, true);
+
+    spin_unlock_irqrestore(&pmdev->spnlck, flags);
+}
+
+static int gpio_irq_set_type(struct irq_data *d, unsigned int type)
+{
+    struct pcmmio_device *pmdev = gpiochip_get_data(irq_data_get_irq_chip_data(d));
+
+    // Only DIO bits 1-24 can interrupt, both edges are emulated
+    if (d->hwirq >= 24)
+        return -EINVAL;
+
+    switch (type) {
+        case IRQ_TYPE_EDGE_RISING:
+            dio_both_edges(pmdev, d->hwirq, false);
+            gpio_update_paged(pmdev, PAGE1, d->hwirq, RISING);
+            return 0;
+
+        case IRQ_TYPE_EDGE_FALLING:
+            dio_both_edges(pmdev, d->hwirq, false);
+            gpio_update_paged(pmdev, PAGE1, d->hwirq, FALLING);
+            return 0;
+
+        case IRQ_TYPE_EDGE_BOTH:
+            return dio_both_edges(pmdev, d->hwirq, true);
+
+        default:
+            return -EINVAL;
+    }
+}
+
+static void gpio_handle_int(struct pcmmio_device *pmdev, int bit_number)
+{
+    unsigned hwirq = bit_number - 1;
+
+    if (!pmdev->gpio_registered || !test_bit(hwirq, &pmdev->gpio_irq_enabled))
+        return;
+
+    generic_handle_irq(irq_find_mapping(pmdev->gpio.irq.domain, hwirq));
+}
+
+static int gpio_init_irq(struct pcmmio_device *pmdev)
+{
+    struct irq_chip *ic = &pmdev->gpio_irq;
+
+    ic->name = pmdev->name;
+    ic->irq_mask = gpio_irq_mask;
+    ic->irq_unmask = gpio_irq_unmask;
+    ic->irq_set_type = gpio_irq_set_type;
+
+    return gpiochip_irqchip_add(&pmdev->gpio, ic, 0, handle_simple_irq, IRQ_TYPE_NONE);
+}
+
+#else
+
+static void gpio_handle_int(struct pcmmio_device *pmdev, int bit_number)
+{
+}
+
+static int gpio_init_irq(struct pcmmio_device *pmdev)
+{
+    return 0;
+}
+
+#endif /* CONFIG_GPIOLIB_IRQCHIP */
+
+static void gpio_init(struct pcmmio_device *pmdev)
+{
+    struct gpio_chip *gc = &pmdev->gpio;
+    int ret;
+
+    gc->label = pmdev->name;
+    gc->parent = IS_ERR_OR_NULL(pmdev->dev) ? NULL : pmdev->dev;
+    gc->owner = THIS_MODULE;
+    gc->base = -1;
+    gc->ngpio = 48;
+    gc->can_sleep = false;
+    gc->get = gpio_get;
+    gc->get_multiple = gpio_get_multiple;
+    gc->set = gpio_set;
+    gc->set_multiple = gpio_set_multiple;
+    gc->get_direction = gpio_get_direction;
+    gc->direction_input = gpio_direction_input;
+    gc->direction_output = gpio_direction_output;
+
+    // GPIO access is an extra, the ioctl interface works without it
+    ret = gpiochip_add_data(gc, pmdev);
+    if (ret) {
+        pr_warning("[%s] Unable to register GPIO chip (%d)\n", pmdev->name, ret);
+        return;
+    }
+
+    ret = gpio_init_irq(pmdev);
+    if (ret)
+        pr_warning("[%s] Unable to add GPIO interrupts (%d)\n", pmdev->name, ret);
+
+    pmdev->gpio_registered = true;
+}
+
+static void gpio_exit(struct pcmmio_device *pmdev)
+{
+    if (pmdev->gpio_registered)
+        gpiochip_remove(&pmdev->gpio);
+
+    pmdev->gpio_registered = false;
+}
+
+#else
+
+static void gpio_init(struct pcmmio_device *pmdev)
+{
+}
+
+static void gpio_exit(struct pcmmio_device *pmdev)
+{
+}
+
+static void gpio_handle_int(struct pcmmio_device *pmdev, int bit_number)
+{
+}
+
+#endif /* CONFIG_GPIOLIB */